@@ -8,8 +8,71 @@
 #define _OUICHEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/cpumask.h>
+#include <linux/percpu_counter.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
 #include "ouichefs.h"
 
+/*
+ * The inode bitmap is protected by sbi->bitmap_lock. The block bitmap is
+ * split between the allocation groups, each group has its own part (indexed
+ * from its first block) protected by its lock, which also protects the free
+ * extents, free count and cursor of the group. Locks are only held while bits
+ * are searched and flipped. The free counts of the whole partition are per-cpu
+ * counters updated outside of them.
+ * The bitmap of a group is loaded on first use by ouichefs_load_group(), which
+ * may sleep: only the functions that may sleep load it, the others treat a
+ * group that is not loaded yet as full.
+ */
+
+/*
+ * Each free bitmap comes with a summary bitmap holding one bit per word of the
+ * free bitmap, set if that word has at least one free bit. Finding a free bit
+ * only scans the summary, which is 64 times smaller, and then a single word.
+ */
+
+/*
+ * Each free bitmap also has a dirty bitmap, with one bit per block of the
+ * bitmap on disk, set when a bit of that block changes. Syncing only writes
+ * back the blocks that changed. Dirty bits are set atomically, they are
+ * cleared by the sync.
+ */
+#define BITMAP_BLOCK(i) ((i) / (OUICHEFS_BLOCK_SIZE * 8))
+
+/*
+ * Allocate and fill the summary of a free bitmap of size bits.
+ * Return NULL on allocation failure.
+ */
+static inline unsigned long *alloc_summary(unsigned long *freemap,
+					   unsigned long size)
+{
+	unsigned long nr_words = BITS_TO_LONGS(size);
+	unsigned long *summary, i;
+
+	summary = bitmap_zalloc(nr_words, GFP_KERNEL);
+	if (!summary)
+		return NULL;
+
+	for (i = 0; i < nr_words; i++)
+		if (freemap[i])
+			__set_bit(i, summary);
+
+	return summary;
+}
+
+/*
+ * Clear bit i in freemap, and its word in summary if it has no free bit left.
+ */
+static inline void clear_free_bit(unsigned long *freemap,
+				  unsigned long *summary, uint32_t i)
+{
+	__clear_bit(i, freemap);
+	if (!freemap[BIT_WORD(i)])
+		__clear_bit(BIT_WORD(i), summary);
+}
+
 /*
  * Return the first free bit (set to 1) in a given in-memory bitmap spanning
  * over multiple blocks and clear it.
@@ -18,15 +81,23 @@
  * error value).
  */
 static inline uint32_t get_first_free_bit(unsigned long *freemap,
+					  unsigned long *summary,
+					  unsigned long *dirty,
 					  unsigned long size)
 {
+	unsigned long word;
 	uint32_t ino;
 
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
+	word = find_first_bit(summary, BITS_TO_LONGS(size));
+	if (word >= BITS_TO_LONGS(size))
 		return 0;
 
-	bitmap_clear(freemap, ino, 1);
+	ino = word * BITS_PER_LONG + __ffs(freemap[word]);
+	if (ino >= size)
+		return 0;
+
+	clear_free_bit(freemap, summary, ino);
+	set_bit(BITMAP_BLOCK(ino), dirty);
 
 	return ino;
 }
@@ -39,43 +110,250 @@ static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
 {
 	uint32_t ret;
 
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
+	spin_lock(&sbi->bitmap_lock);
+	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->ifree_summary,
+				 sbi->ifree_dirty, sbi->nr_inodes);
+	spin_unlock(&sbi->bitmap_lock);
 	if (ret) {
-		sbi->nr_free_inodes--;
+		percpu_counter_dec(&sbi->free_inodes);
 		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
 			 ret);
 	}
 	return ret;
 }
 
+/*
+ * Return the first free bit at or after start in the range [first, end) of a
+ * given in-memory bitmap, wrapping around to first if needed, without clearing
+ * it. first must be a multiple of BITS_PER_LONG.
+ * Return end if no free bit found.
+ */
+static inline unsigned long find_free_bit_in(unsigned long *freemap,
+					     unsigned long *summary,
+					     unsigned long first,
+					     unsigned long end,
+					     unsigned long start)
+{
+	unsigned long nr_words = BITS_TO_LONGS(end);
+	unsigned long word, bits, bit;
+
+	if (start < first || start >= end)
+		start = first;
+
+	/* Free bits following start in its own word */
+	word = BIT_WORD(start);
+	bits = freemap[word] & BITMAP_FIRST_WORD_MASK(start);
+	if (bits) {
+		bit = word * BITS_PER_LONG + __ffs(bits);
+		if (bit < end)
+			return bit;
+	}
+
+	/* Then the next word with a free bit, from first if none */
+	word = find_next_bit(summary, nr_words, word + 1);
+	if (word < nr_words && freemap[word]) {
+		bit = word * BITS_PER_LONG + __ffs(freemap[word]);
+		if (bit < end)
+			return bit;
+	}
+	word = find_next_bit(summary, nr_words, BIT_WORD(first));
+	if (word < nr_words && freemap[word]) {
+		bit = word * BITS_PER_LONG + __ffs(freemap[word]);
+		if (bit < end)
+			return bit;
+	}
+
+	return end;
+}
+
+/* Return the allocation group of block bno */
+static inline uint32_t block_group(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	return bno / sbi->blocks_per_group;
+}
+
+/* Return the first block of group g */
+static inline uint32_t group_first_block(struct ouichefs_sb_info *sbi,
+					 uint32_t g)
+{
+	return g * sbi->blocks_per_group;
+}
+
+/* Return the block following the last block of group g */
+static inline uint32_t group_end_block(struct ouichefs_sb_info *sbi,
+				       uint32_t g)
+{
+	return min_t(uint64_t, (uint64_t)(g + 1) * sbi->blocks_per_group,
+		     sbi->nr_blocks);
+}
+
+/* Return the allocation group of the current CPU */
+static inline uint32_t cpu_group(struct ouichefs_sb_info *sbi)
+{
+	return raw_smp_processor_id() % sbi->nr_groups;
+}
+
+/*
+ * Return an unused block number of group g, the first one at or after start
+ * (or after the cursor of the group if start is 0 or outside of it), and mark
+ * it used. Full groups are skipped, the following groups are tried in turn.
+ * Groups that are not loaded yet are loaded, this may sleep.
+ * Return 0 if no free block was found.
+ */
+static inline uint32_t get_free_block_from(struct ouichefs_sb_info *sbi,
+					   uint32_t g, uint32_t start)
+{
+	struct ouichefs_group *grp;
+	unsigned long first, end, ret;
+	uint32_t i;
+
+	for (i = 0; i < sbi->nr_groups; i++, g = (g + 1) % sbi->nr_groups) {
+		grp = &sbi->groups[g];
+		if (!READ_ONCE(grp->nr_free))
+			continue;
+		if (!READ_ONCE(grp->bitmap) && ouichefs_load_group(sbi, g))
+			continue;
+
+		first = group_first_block(sbi, g);
+		end = group_end_block(sbi, g);
+
+		spin_lock(&grp->lock);
+		if (!start || start < first || start >= end)
+			start = grp->cursor;
+		ret = find_free_bit_in(grp->bitmap, grp->summary, 0, end - first,
+				       start - first);
+		if (ret < end - first) {
+			clear_free_bit(grp->bitmap, grp->summary, ret);
+			ret += first;
+			set_bit(BITMAP_BLOCK(ret), sbi->bfree_dirty);
+			ouichefs_extent_alloc(sbi, ret);
+			grp->nr_free--;
+			grp->cursor = ret + 1;
+			spin_unlock(&grp->lock);
+
+			percpu_counter_dec(&sbi->free_blocks);
+			pr_debug("%s:%d: allocated block %lu in group %u\n",
+				 __func__, __LINE__, ret, g);
+			return ret;
+		}
+		spin_unlock(&grp->lock);
+	}
+
+	return 0;
+}
+
+/*
+ * Return an unused block number, as close as possible after goal, and mark it
+ * used. Without goal (0), the search starts at the cursor of the allocation
+ * group of the current CPU, so that concurrent writers on different CPUs
+ * don't contend, and the blocks of their files don't interleave.
+ * Return 0 if no free block was found.
+ */
+static inline uint32_t get_free_block_near(struct ouichefs_sb_info *sbi,
+					   uint32_t goal)
+{
+	if (goal && goal < sbi->nr_blocks)
+		return get_free_block_from(sbi, block_group(sbi, goal), goal);
+
+	return get_free_block_from(sbi, cpu_group(sbi), 0);
+}
+
 /*
  * Return an unused block number and mark it used.
  * Return 0 if no free block was found.
  */
 static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
 {
-	uint32_t ret;
+	return get_free_block_near(sbi, 0);
+}
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
-		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
-			 ret);
+/*
+ * Mark block bno as used if it is free. Never sleeps, a block of a group that
+ * is not loaded yet is not taken.
+ * Return bno on success, 0 if the block is already used or out of range.
+ */
+static inline uint32_t get_free_block_at(struct ouichefs_sb_info *sbi,
+					 uint32_t bno)
+{
+	struct ouichefs_group *grp;
+	uint32_t g, i;
+
+	if (bno >= sbi->nr_blocks)
+		return 0;
+
+	g = block_group(sbi, bno);
+	grp = &sbi->groups[g];
+	i = bno - group_first_block(sbi, g);
+	spin_lock(&grp->lock);
+	if (!grp->bitmap || !test_bit(i, grp->bitmap)) {
+		spin_unlock(&grp->lock);
+		return 0;
 	}
-	return ret;
+	clear_free_bit(grp->bitmap, grp->summary, i);
+	set_bit(BITMAP_BLOCK(bno), sbi->bfree_dirty);
+	ouichefs_extent_alloc(sbi, bno);
+	grp->nr_free--;
+	spin_unlock(&grp->lock);
+
+	percpu_counter_dec(&sbi->free_blocks);
+	pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__, bno);
+
+	return bno;
+}
+
+/*
+ * Delayed writes only reserve their blocks in sbi->reserved_blocks, writeback
+ * gives them a place on disk later (see file.c). Reserved blocks are still
+ * free in the bitmap, but not available to anybody else.
+ * Return true if nr blocks are free and not reserved.
+ */
+static inline bool has_free_blocks(struct ouichefs_sb_info *sbi, s64 nr)
+{
+	s64 free = percpu_counter_read_positive(&sbi->free_blocks);
+	s64 reserved = percpu_counter_read_positive(&sbi->reserved_blocks);
+
+	/* Only pay for exact sums when the approximate ones are too close */
+	if (free - reserved - nr < 2 * percpu_counter_batch * num_online_cpus()) {
+		free = percpu_counter_sum_positive(&sbi->free_blocks);
+		reserved = percpu_counter_sum_positive(&sbi->reserved_blocks);
+	}
+
+	return free - reserved >= nr;
+}
+
+/*
+ * Reserve a block for a delayed write.
+ * Return 0 on success, -ENOSPC if no block is available.
+ */
+static inline int reserve_block(struct ouichefs_sb_info *sbi)
+{
+	if (!has_free_blocks(sbi, 1))
+		return -ENOSPC;
+	percpu_counter_inc(&sbi->reserved_blocks);
+
+	return 0;
+}
+
+/* Give back nr reserved blocks, once allocated or when the write is dropped */
+static inline void unreserve_blocks(struct ouichefs_sb_info *sbi, s64 nr)
+{
+	percpu_counter_sub(&sbi->reserved_blocks, nr);
 }
 
 /*
  * Mark the i-th bit in freemap as free (i.e. 1)
+ * Return -1 if i is out of range or already free.
  */
-static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
+static inline int put_free_bit(unsigned long *freemap, unsigned long *summary,
+			       unsigned long size, uint32_t i)
 {
 	/* i is greater than freemap size */
 	if (i > size)
 		return -1;
 
-	bitmap_set(freemap, i, 1);
+	if (__test_and_set_bit(i, freemap))
+		return -1;
+	__set_bit(BIT_WORD(i), summary);
 
 	return 0;
 }
@@ -85,23 +363,92 @@ static inline int put_free_bit(unsigned long *freemap, unsigned long size,
  */
 static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
+	int ret;
+
+	spin_lock(&sbi->bitmap_lock);
+	ret = put_free_bit(sbi->ifree_bitmap, sbi->ifree_summary,
+			   sbi->nr_inodes, ino);
+	if (!ret)
+		set_bit(BITMAP_BLOCK(ino), sbi->ifree_dirty);
+	spin_unlock(&sbi->bitmap_lock);
+	if (ret)
 		return;
 
-	sbi->nr_free_inodes++;
+	percpu_counter_inc(&sbi->free_inodes);
 	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
 }
 
 /*
- * Mark a block as unused.
+ * Mark the len blocks starting at start as unused, taking the lock of each of
+ * their groups once. Never sleeps: their groups must be loaded already, which
+ * holds for blocks taken since the mount.
+ */
+static inline void put_loaded_blocks(struct ouichefs_sb_info *sbi,
+				     uint32_t start, uint32_t len)
+{
+	struct ouichefs_group *grp;
+	uint32_t g, first, end, nr, i, freed;
+
+	if (start >= sbi->nr_blocks)
+		return;
+	len = min(len, sbi->nr_blocks - start);
+
+	for (; len; start += nr, len -= nr) {
+		g = block_group(sbi, start);
+		grp = &sbi->groups[g];
+		first = group_first_block(sbi, g);
+		end = group_end_block(sbi, g);
+		nr = min(len, end - start);
+
+		spin_lock(&grp->lock);
+		if (WARN_ON_ONCE(!grp->bitmap)) {
+			spin_unlock(&grp->lock);
+			pr_err("group %u is not loaded, blocks %u to %u are lost\n",
+			       g, start, start + nr - 1);
+			continue;
+		}
+		freed = 0;
+		for (i = start - first; i < start - first + nr; i++)
+			if (!put_free_bit(grp->bitmap, grp->summary, end - first,
+					  i))
+				freed++;
+		if (freed) {
+			for (i = BITMAP_BLOCK(start);
+			     i <= BITMAP_BLOCK(start + nr - 1); i++)
+				set_bit(i, sbi->bfree_dirty);
+			/* Some of them were already free, index them again */
+			if (freed == nr)
+				ouichefs_extent_free(sbi, start, nr);
+			else
+				ouichefs_extent_invalidate(sbi, start);
+			grp->nr_free += freed;
+		}
+		spin_unlock(&grp->lock);
+
+		percpu_counter_add(&sbi->free_blocks, freed);
+		pr_debug("%s:%d: freed %u blocks from %u\n", __func__, __LINE__,
+			 freed, start);
+	}
+}
+
+/*
+ * Mark a block as unused. The group of a block allocated before the mount may
+ * not be loaded yet, it is loaded then, which may sleep.
  */
 static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
+	uint32_t g;
+
+	if (bno >= sbi->nr_blocks)
 		return;
 
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	g = block_group(sbi, bno);
+	if (!READ_ONCE(sbi->groups[g].bitmap) && ouichefs_load_group(sbi, g)) {
+		pr_err("failed to load group %u, block %u is lost\n", g, bno);
+		return;
+	}
+
+	put_loaded_blocks(sbi, bno, 1);
 }
 
 #endif /* _OUICHEFS_BITMAP_H */
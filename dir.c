@@ -9,60 +9,768 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/xarray.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * The entries of a directory are indexed in memory by name and by inode the
+ * first time the directory is used, so that lookups and updates don't have to
+ * compare every name. The index mirrors the buckets on disk: it is updated
+ * along with them, with the directory inode locked. If an update fails to
+ * allocate memory, the index is dropped and built again on next use.
+ *
+ * Entries of a hashed directory go in the bucket of the hash of their name,
+ * which is part of the disk format and must not change.
+ *
+ * Removing an entry only clears its slot, which the next entry added to the
+ * bucket takes back: entries never move, so readdir positions stay valid, and
+ * a bucket needs no compaction. The free slots of a bucket are tracked in its
+ * used bitmap.
+ *
+ * The index only holds the buckets that have a block, and its hash tables
+ * grow with the number of entries, so that the many small directories of a
+ * tree don't cost much memory.
+ */
+
+/* Size of the hash tables of an empty directory */
+#define DIR_HASH_MIN_BITS 4
+
+/* FNV-1a hash of name */
+static uint32_t dir_hash(const char *name, unsigned int len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static struct hlist_head *dir_name_head(struct ouichefs_dir_index *idx,
+					uint32_t hash)
+{
+	return &idx->by_name[hash_32(hash, idx->bits)];
+}
+
+static struct hlist_head *dir_ino_head(struct ouichefs_dir_index *idx,
+				       uint32_t ino)
+{
+	return &idx->by_ino[hash_32(ino, idx->bits)];
+}
+
+static struct ouichefs_dir_bucket *dir_bucket(struct ouichefs_dir_index *idx,
+					      uint32_t b)
+{
+	return xa_load(&idx->buckets, b);
+}
+
+/*
+ * Return the first bucket of idx numbered *b or more, and set *b to its
+ * number. Return NULL if there is none.
+ */
+static struct ouichefs_dir_bucket *
+dir_next_bucket(struct ouichefs_dir_index *idx, uint32_t *b)
+{
+	struct ouichefs_dir_bucket *bucket;
+	unsigned long index = *b;
+
+	bucket = xa_find(&idx->buckets, &index, idx->nr_buckets - 1,
+			 XA_PRESENT);
+	if (bucket)
+		*b = index;
+
+	return bucket;
+}
+
+/* Index bucket b, stored in block bno, with no entry. Return it, or NULL */
+static struct ouichefs_dir_bucket *
+dir_index_add_bucket(struct ouichefs_dir_index *idx, uint32_t b, uint32_t bno)
+{
+	struct ouichefs_dir_bucket *bucket;
+
+	bucket = kzalloc(sizeof(*bucket), GFP_NOFS);
+	if (!bucket)
+		return NULL;
+	bucket->bno = bno;
+	if (xa_err(xa_store(&idx->buckets, b, bucket, GFP_NOFS))) {
+		kfree(bucket);
+		return NULL;
+	}
+
+	return bucket;
+}
+
+static void dir_bucket_free(struct ouichefs_dir_bucket *bucket)
+{
+	uint32_t i;
+
+	for_each_set_bit(i, bucket->used, OUICHEFS_MAX_SUBFILES)
+		kfree(bucket->slots[i]);
+	kfree(bucket->slots);
+	kfree(bucket);
+}
+
+/* Forget bucket b and its entries */
+static void dir_index_del_bucket(struct ouichefs_dir_index *idx, uint32_t b)
+{
+	struct ouichefs_dir_bucket *bucket = xa_erase(&idx->buckets, b);
+
+	if (bucket)
+		dir_bucket_free(bucket);
+}
+
+static void dir_index_free(struct ouichefs_dir_index *idx)
+{
+	struct ouichefs_dir_bucket *bucket;
+	unsigned long b;
+
+	xa_for_each(&idx->buckets, b, bucket)
+		dir_bucket_free(bucket);
+	xa_destroy(&idx->buckets);
+	kvfree(idx->by_name);
+	kvfree(idx->by_ino);
+	kfree(idx);
+}
+
+static struct hlist_head *dir_alloc_heads(unsigned int bits)
+{
+	struct hlist_head *heads;
+	uint32_t i;
+
+	heads = kvmalloc_array(1U << bits, sizeof(*heads), GFP_NOFS);
+	if (!heads)
+		return NULL;
+	for (i = 0; i < 1U << bits; i++)
+		INIT_HLIST_HEAD(&heads[i]);
+
+	return heads;
+}
+
+/*
+ * Double the size of the hash tables of idx, and move the entries to the new
+ * ones. If that fails to allocate, the tables are kept with longer chains.
+ */
+static void dir_index_grow(struct ouichefs_dir_index *idx)
+{
+	struct hlist_head *old_name = idx->by_name, *old_ino = idx->by_ino;
+	struct hlist_head *by_name, *by_ino;
+	struct ouichefs_dir_entry *e;
+	struct hlist_node *tmp;
+	uint32_t i, size = 1U << idx->bits;
+
+	by_name = dir_alloc_heads(idx->bits + 1);
+	by_ino = dir_alloc_heads(idx->bits + 1);
+	if (!by_name || !by_ino) {
+		kvfree(by_name);
+		kvfree(by_ino);
+		return;
+	}
+
+	idx->by_name = by_name;
+	idx->by_ino = by_ino;
+	idx->bits++;
+	for (i = 0; i < size; i++) {
+		hlist_for_each_entry_safe(e, tmp, &old_name[i], by_name)
+			hlist_add_head(&e->by_name,
+				       dir_name_head(idx, e->hash));
+		hlist_for_each_entry_safe(e, tmp, &old_ino[i], by_ino)
+			hlist_add_head(&e->by_ino, dir_ino_head(idx, e->ino));
+	}
+	kvfree(old_name);
+	kvfree(old_ino);
+}
+
+/*
+ * Index ino under name, with file type type (FT_*), in slot slot of bucket b,
+ * which must be indexed.
+ * Return 0 or -ENOMEM.
+ */
+static int dir_index_insert(struct ouichefs_dir_index *idx, uint32_t b,
+			    uint32_t slot, uint32_t ino, const char *name,
+			    uint8_t type)
+{
+	struct ouichefs_dir_bucket *bucket = dir_bucket(idx, b);
+	struct ouichefs_dir_entry *e;
+
+	if (!bucket->slots) {
+		bucket->slots = kcalloc(OUICHEFS_MAX_SUBFILES,
+					sizeof(*bucket->slots), GFP_NOFS);
+		if (!bucket->slots)
+			return -ENOMEM;
+	}
+	e = kmalloc(sizeof(*e), GFP_NOFS);
+	if (!e)
+		return -ENOMEM;
+	e->ino = ino;
+	e->bucket = b;
+	e->slot = slot;
+	e->type = type;
+	strscpy(e->name, name, OUICHEFS_FILENAME_LEN);
+	e->hash = dir_hash(e->name, strlen(e->name));
+	hlist_add_head(&e->by_name, dir_name_head(idx, e->hash));
+	hlist_add_head(&e->by_ino, dir_ino_head(idx, ino));
+	bucket->slots[slot] = e;
+	__set_bit(slot, bucket->used);
+	bucket->nr_files++;
+	idx->nr_files++;
+	if (idx->nr_files > 1U << idx->bits)
+		dir_index_grow(idx);
+
+	return 0;
+}
+
+/* Forget e, its slot becomes free */
+static void dir_index_remove(struct ouichefs_dir_index *idx,
+			     struct ouichefs_dir_entry *e)
+{
+	struct ouichefs_dir_bucket *bucket = dir_bucket(idx, e->bucket);
+
+	hlist_del(&e->by_name);
+	hlist_del(&e->by_ino);
+
+	bucket->slots[e->slot] = NULL;
+	__clear_bit(e->slot, bucket->used);
+	bucket->nr_files--;
+	idx->nr_files--;
+	kfree(e);
+}
+
+/* Index the entries of bucket b, read from block bno */
+static int dir_index_read_bucket(struct super_block *sb,
+				 struct ouichefs_dir_index *idx, uint32_t b,
+				 uint32_t bno)
+{
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	uint32_t i;
+	uint8_t type = FT_UNKNOWN;
+	int ret = 0;
+
+	if (!dir_index_add_bucket(idx, b, bno))
+		return -ENOMEM;
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
+		if (!dblock->files[i].inode)
+			continue;
+		if (OUICHEFS_HAS_FEATURE(sb, FILETYPE))
+			type = dblock->files[i].filename[OUICHEFS_FILETYPE_BYTE];
+		ret = dir_index_insert(idx, b, i, dblock->files[i].inode,
+				       dblock->files[i].filename, type);
+		if (ret)
+			break;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Index the buckets listed in the index block of a hashed directory. Their
+ * blocks are all read ahead at once.
+ */
+static int dir_index_read_buckets(struct super_block *sb,
+				  struct ouichefs_dir_index *idx,
+				  uint32_t index_block)
+{
+	struct ouichefs_dir_index_block *dindex;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	uint32_t b;
+	int ret = 0;
+
+	bh = sb_bread(sb, index_block);
+	if (!bh)
+		return -EIO;
+	dindex = (struct ouichefs_dir_index_block *)bh->b_data;
+
+	blk_start_plug(&plug);
+	for (b = 0; b < OUICHEFS_DIR_BUCKETS; b++)
+		if (dindex->buckets[b])
+			sb_breadahead(sb, dindex->buckets[b]);
+	blk_finish_plug(&plug);
+
+	for (b = 0; b < OUICHEFS_DIR_BUCKETS; b++) {
+		if (!dindex->buckets[b])
+			continue;
+		ret = dir_index_read_bucket(sb, idx, b, dindex->buckets[b]);
+		if (ret)
+			break;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+static struct ouichefs_dir_index *dir_index_build(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index *idx;
+	uint32_t nr_buckets = 1;
+	int ret;
+
+	if (OUICHEFS_HAS_FEATURE(sb, HASHED_DIRS))
+		nr_buckets = OUICHEFS_DIR_BUCKETS;
+
+	idx = kzalloc(sizeof(*idx), GFP_NOFS);
+	if (!idx)
+		return ERR_PTR(-ENOMEM);
+	idx->nr_buckets = nr_buckets;
+	xa_init(&idx->buckets);
+	idx->bits = DIR_HASH_MIN_BITS;
+	idx->by_name = dir_alloc_heads(idx->bits);
+	idx->by_ino = dir_alloc_heads(idx->bits);
+	if (!idx->by_name || !idx->by_ino) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	if (nr_buckets == 1)
+		ret = dir_index_read_bucket(sb, idx, 0,
+					    OUICHEFS_INODE(dir)->index_block);
+	else
+		ret = dir_index_read_buckets(sb, idx,
+					     OUICHEFS_INODE(dir)->index_block);
+	if (ret)
+		goto free;
+
+	return idx;
+
+free:
+	dir_index_free(idx);
+	return ERR_PTR(ret);
+}
+
+/*
+ * Return the index of dir, built from the directory blocks if needed, or an
+ * error pointer. Must hold the directory inode lock, at least shared.
+ */
+struct ouichefs_dir_index *ouichefs_dir_index_get(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_index *idx, *old;
+
+	idx = READ_ONCE(ci->dir_index);
+	if (idx)
+		return idx;
+
+	idx = dir_index_build(dir);
+	if (IS_ERR(idx))
+		return idx;
+
+	/* Concurrent lookups may build it too, the first one wins */
+	old = cmpxchg(&ci->dir_index, NULL, idx);
+	if (old) {
+		dir_index_free(idx);
+		return old;
+	}
+
+	return idx;
+}
+
+/* Free the index of dir, if any */
+void ouichefs_dir_index_drop(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+
+	if (ci->dir_index) {
+		dir_index_free(ci->dir_index);
+		ci->dir_index = NULL;
+	}
+}
+
+/* Return the entry of idx named name (len bytes long), or NULL */
+struct ouichefs_dir_entry *ouichefs_dir_find(struct ouichefs_dir_index *idx,
+					     const char *name,
+					     unsigned int len)
+{
+	struct ouichefs_dir_entry *e;
+	uint32_t hash;
+
+	/* Names are stored with their terminating NUL */
+	if (len >= OUICHEFS_FILENAME_LEN)
+		return NULL;
+
+	hash = dir_hash(name, len);
+	hlist_for_each_entry(e, dir_name_head(idx, hash), by_name) {
+		if (e->hash == hash && !strncmp(e->name, name, len) &&
+		    !e->name[len])
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Return the entry of idx for inode ino, or NULL */
+struct ouichefs_dir_entry *
+ouichefs_dir_find_ino(struct ouichefs_dir_index *idx, uint32_t ino)
+{
+	struct ouichefs_dir_entry *e;
+
+	hlist_for_each_entry(e, dir_ino_head(idx, ino), by_ino) {
+		if (e->ino == ino)
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Give bucket b of dir a new empty block, which counts in the size of dir.
+ * Return the bucket, or an error pointer.
+ */
+static struct ouichefs_dir_bucket *
+dir_alloc_bucket(struct inode *dir, struct ouichefs_dir_index *idx, uint32_t b)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dir_index_block *dindex;
+	struct ouichefs_dir_bucket *bucket;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int ret = -ENOSPC;
+
+	if (!has_free_blocks(sbi, 1))
+		return ERR_PTR(-ENOSPC);
+	bucket = dir_index_add_bucket(idx, b, 0);
+	if (!bucket)
+		return ERR_PTR(-ENOMEM);
+	bno = get_free_block_near(sbi, OUICHEFS_INODE(dir)->index_block);
+	if (!bno)
+		goto del_bucket;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		goto put_block;
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		goto put_block;
+	dindex = (struct ouichefs_dir_index_block *)bh->b_data;
+	dindex->buckets[b] = bno;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	bucket->bno = bno;
+	dir->i_blocks++;
+	dir->i_size += OUICHEFS_BLOCK_SIZE;
+	mark_inode_dirty(dir);
+
+	return bucket;
+
+put_block:
+	put_block(sbi, bno);
+	ret = -EIO;
+del_bucket:
+	dir_index_del_bucket(idx, b);
+	return ERR_PTR(ret);
+}
+
+/* Give back the block of bucket b of dir, which is empty */
+static void dir_free_bucket(struct inode *dir, struct ouichefs_dir_index *idx,
+			    uint32_t b)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index_block *dindex;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		return;
+	dindex = (struct ouichefs_dir_index_block *)bh->b_data;
+	dindex->buckets[b] = 0;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	put_block(OUICHEFS_SB(sb), dir_bucket(idx, b)->bno);
+	dir_index_del_bucket(idx, b);
+	/* Older directories did not count their buckets */
+	if (dir->i_blocks > 1) {
+		dir->i_blocks--;
+		dir->i_size -= OUICHEFS_BLOCK_SIZE;
+		mark_inode_dirty(dir);
+	}
+}
+
+/*
+ * Add an entry for inode named name in dir, in the first free slot of its
+ * bucket. Must hold the directory inode lock.
+ * Return 0 on success, -EMLINK if the bucket of name is full, or another
+ * negative error code.
+ */
+int ouichefs_dir_add(struct inode *dir, struct inode *inode, const char *name)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index *idx;
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	char fname[OUICHEFS_FILENAME_LEN];
+	uint8_t type = FT_UNKNOWN;
+	uint32_t b, slot;
+
+	idx = ouichefs_dir_index_get(dir);
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
+
+	strscpy(fname, name, OUICHEFS_NAME_LEN(sb));
+	if (OUICHEFS_HAS_FEATURE(sb, FILETYPE))
+		type = fs_umode_to_ftype(inode->i_mode);
+	b = dir_hash(fname, strlen(fname)) % idx->nr_buckets;
+	bucket = dir_bucket(idx, b);
+	if (!bucket) {
+		bucket = dir_alloc_bucket(dir, idx, b);
+		if (IS_ERR(bucket))
+			return PTR_ERR(bucket);
+	}
+	slot = find_first_zero_bit(bucket->used, OUICHEFS_MAX_SUBFILES);
+	if (slot >= OUICHEFS_MAX_SUBFILES)
+		return -EMLINK;
+
+	bh = sb_bread(sb, bucket->bno);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	memset(&dblock->files[slot], 0, sizeof(struct ouichefs_file));
+	dblock->files[slot].inode = inode->i_ino;
+	strscpy(dblock->files[slot].filename, fname, OUICHEFS_NAME_LEN(sb));
+	if (OUICHEFS_HAS_FEATURE(sb, FILETYPE))
+		dblock->files[slot].filename[OUICHEFS_FILETYPE_BYTE] = type;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	if (dir_index_insert(idx, b, slot, inode->i_ino, fname, type))
+		ouichefs_dir_index_drop(dir);
+
+	return 0;
+}
+
+/* Remove entry e of dir, and free its bucket if it is left empty */
+static int dir_del_entry(struct inode *dir, struct ouichefs_dir_index *idx,
+			 struct ouichefs_dir_entry *e)
+{
+	struct ouichefs_dir_bucket *bucket = dir_bucket(idx, e->bucket);
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	uint32_t b = e->bucket;
+
+	bh = sb_bread(dir->i_sb, bucket->bno);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+	memset(&dblock->files[e->slot], 0, sizeof(struct ouichefs_file));
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	dir_index_remove(idx, e);
+	if (idx->nr_buckets > 1 && !bucket->nr_files)
+		dir_free_bucket(dir, idx, b);
+
+	return 0;
+}
+
+/*
+ * Remove the entry of inode ino from dir. Must hold the directory inode lock.
+ * Return 0 on success, or a negative error code.
+ */
+int ouichefs_dir_del(struct inode *dir, uint32_t ino)
+{
+	struct ouichefs_dir_index *idx;
+	struct ouichefs_dir_entry *e;
+
+	idx = ouichefs_dir_index_get(dir);
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
+	e = ouichefs_dir_find_ino(idx, ino);
+	if (!e)
+		return -ENOENT;
+
+	return dir_del_entry(dir, idx, e);
+}
+
+/*
+ * Rename the entry of inode in dir to name. It moves to another bucket if the
+ * new name hashes to it. Must hold the directory inode lock.
+ * Return 0 on success, or a negative error code.
+ */
+int ouichefs_dir_rename(struct inode *dir, struct inode *inode,
+			const char *name)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dir_index *idx;
+	struct ouichefs_dir_entry *e;
+	struct ouichefs_dir_block *dblock;
+	struct buffer_head *bh;
+	char fname[OUICHEFS_FILENAME_LEN];
+	uint32_t b, slot;
+	int ret;
+
+	idx = ouichefs_dir_index_get(dir);
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
+	e = ouichefs_dir_find_ino(idx, inode->i_ino);
+	if (!e)
+		return -ENOENT;
+
+	strscpy(fname, name, OUICHEFS_NAME_LEN(sb));
+	b = e->bucket;
+	slot = e->slot;
+	if (dir_hash(fname, strlen(fname)) % idx->nr_buckets != b) {
+		ret = ouichefs_dir_add(dir, inode, fname);
+		if (ret)
+			return ret;
+		/* The index may have been built again */
+		idx = ouichefs_dir_index_get(dir);
+		if (IS_ERR(idx))
+			return PTR_ERR(idx);
+		return dir_del_entry(dir, idx, dir_bucket(idx, b)->slots[slot]);
+	}
+
+	bh = sb_bread(sb, dir_bucket(idx, b)->bno);
+	if (!bh)
+		return -EIO;
+	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	/* The file type byte is left as is */
+	strscpy(dblock->files[slot].filename, fname, OUICHEFS_NAME_LEN(sb));
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	hlist_del(&e->by_name);
+	strscpy(e->name, fname, OUICHEFS_FILENAME_LEN);
+	e->hash = dir_hash(e->name, strlen(e->name));
+	hlist_add_head(&e->by_name, dir_name_head(idx, e->hash));
+
+	return 0;
+}
+
+/* Number of entries whose inodes are read ahead at once by readdir */
+#define DIR_RA_BATCH 64
+
+static int dir_cmp_block(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Read ahead the inode store blocks of the next entries of idx, at most
+ * DIR_RA_BATCH of them, from position pos in the buckets. Callers of readdir
+ * often stat each entry right after. Entries of a bucket are not in inode
+ * order, their blocks are sorted so that each one is only read once.
+ */
+static void dir_readahead_inodes(struct super_block *sb,
+				 struct ouichefs_dir_index *idx, loff_t pos)
+{
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_dir_entry *e;
+	uint32_t blocks[DIR_RA_BATCH];
+	struct blk_plug plug;
+	uint32_t b, first, slot, i, nr = 0;
+
+	b = pos / OUICHEFS_MAX_SUBFILES;
+	slot = pos % OUICHEFS_MAX_SUBFILES;
+
+	for (; nr < DIR_RA_BATCH; b++, slot = 0) {
+		first = b;
+		bucket = dir_next_bucket(idx, &b);
+		if (!bucket)
+			break;
+		if (b != first)
+			slot = 0;
+		for_each_set_bit_from(slot, bucket->used, OUICHEFS_MAX_SUBFILES) {
+			e = bucket->slots[slot];
+			blocks[nr] = e->ino / OUICHEFS_INODES_PER_BLOCK + 1;
+			if (++nr == DIR_RA_BATCH)
+				break;
+		}
+	}
+	sort(blocks, nr, sizeof(*blocks), dir_cmp_block, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++)
+		if (!i || blocks[i] != blocks[i - 1])
+			sb_breadahead(sb, blocks[i]);
+	blk_finish_plug(&plug);
+}
 
 /*
  * Iterate over the files contained in dir and commit them in ctx.
- * This function is called by the VFS while ctx->pos changes.
+ * This function is called by the VFS while ctx->pos changes. Past . and ..,
+ * ctx->pos is the position of the next entry in the directory buckets.
  * Return 0 on success.
  */
 static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(dir);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	struct ouichefs_dir_index *idx;
+	struct ouichefs_dir_bucket *bucket;
+	struct ouichefs_dir_entry *e;
+	uint32_t b, first, slot, next, ra = 0;
 
 	/* Check that dir is a directory */
 	if (!S_ISDIR(inode->i_mode))
 		return -ENOTDIR;
 
-	/*
-	 * Check that ctx->pos is not bigger than what we can handle (including
-	 * . and ..)
-	 */
-	if (ctx->pos > OUICHEFS_MAX_SUBFILES + 2)
-		return 0;
-
 	// TODO: possible bug - . and .. arent printed by ls -a
 	/* Commit . and .. to ctx */
 	if (!dir_emit_dots(dir, ctx))
 		return 0;
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
+	idx = ouichefs_dir_index_get(inode);
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
 
-	/* Iterate over the index block and commit subfiles */
-	for (i = ctx->pos - 2; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
+	/* Iterate over the buckets and commit subfiles */
+	while (ctx->pos - 2 < idx->nr_buckets * OUICHEFS_MAX_SUBFILES) {
+		b = (ctx->pos - 2) / OUICHEFS_MAX_SUBFILES;
+		slot = (ctx->pos - 2) % OUICHEFS_MAX_SUBFILES;
+		first = b;
+		bucket = dir_next_bucket(idx, &b);
+		if (!bucket) {
+			ctx->pos = 2 + idx->nr_buckets * OUICHEFS_MAX_SUBFILES;
 			break;
-		if (!dir_emit(ctx, f->filename, OUICHEFS_FILENAME_LEN, f->inode,
-			      DT_UNKNOWN))
+		}
+		if (b != first) {
+			/* Skip the buckets without a block */
+			ctx->pos = 2 + b * OUICHEFS_MAX_SUBFILES;
+			continue;
+		}
+		next = find_next_bit(bucket->used, OUICHEFS_MAX_SUBFILES, slot);
+		if (next != slot) {
+			/* Skip the free slots, up to the next bucket */
+			ctx->pos += next - slot;
+			continue;
+		}
+		if (!ra) {
+			/* The inode blocks of the next entries are read ahead */
+			dir_readahead_inodes(inode->i_sb, idx, ctx->pos - 2);
+			ra = DIR_RA_BATCH;
+		}
+		ra--;
+		e = bucket->slots[slot];
+		if (!dir_emit(ctx, e->name, strlen(e->name), e->ino,
+			      fs_ftype_to_dtype(e->type)))
 			break;
 		ctx->pos++;
 	}
 
-	brelse(bh);
-
 	return 0;
 }
 
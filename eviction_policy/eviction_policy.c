@@ -4,8 +4,10 @@
 #include <linux/kernel.h>
 #include <linux/buffer_head.h>
 #include <linux/fdtable.h>
+#include <linux/slab.h>
 
 #include "../ouichefs.h"
+#include "../bitmap.h"
 #include "eviction_policy.h"
 
 // MARK: - Module parameters
@@ -14,6 +16,11 @@ int trigger_threshold = 20;
 module_param(trigger_threshold, int, 0644);
 MODULE_PARM_DESC(trigger_threshold, "Trigger threshold for eviction policy");
 
+int eviction_high_watermark = 30;
+module_param(eviction_high_watermark, int, 0644);
+MODULE_PARM_DESC(eviction_high_watermark,
+		 "Percentage of free blocks at which background eviction stops");
+
 // MARK: - Default eviction policy
 
 static int clean_partition_placeholder(struct super_block *sb)
@@ -31,15 +38,26 @@ static int clean_dir_placeholder(struct super_block *sb, struct inode *parent,
 	return 0;
 }
 
+static int reclaim_placeholder(struct super_block *sb, uint32_t nr_blocks)
+{
+	pr_info("got superblock: %s, %u blocks to free\n", sb->s_id, nr_blocks);
+
+	return 0;
+}
+
 struct ouichefs_eviction_policy default_policy = {
 	.name = "default",
 	.clean_partition = clean_partition_placeholder,
+	.reclaim = reclaim_placeholder,
 	.clean_dir = clean_dir_placeholder,
 	.list_head = LIST_HEAD_INIT(default_policy.list_head),
 };
 
 struct ouichefs_eviction_policy *current_policy = &default_policy;
 
+/* Bumped whenever current_policy changes, victim indexes are then re-sorted */
+static unsigned int policy_generation;
+
 // MARK: - Eviction policy functions
 
 /**
@@ -73,6 +91,7 @@ int register_eviction_policy(struct ouichefs_eviction_policy *policy)
 
 	// change to the new policy after inserting (helpful mostly for development)
 	current_policy = policy;
+	policy_generation++;
 
 	pr_info("registered eviction policy '%s'\n", policy->name);
 
@@ -106,8 +125,10 @@ void unregister_eviction_policy(struct ouichefs_eviction_policy *policy)
 	}
 
 	/* If current policy is unregistered then fallback to default */
-	if (current_policy == policy)
+	if (current_policy == policy) {
 		current_policy = &default_policy;
+		policy_generation++;
+	}
 
 	list_del(&policy->list_head);
 
@@ -139,6 +160,7 @@ int set_eviction_policy(const char *name)
 	list_for_each_entry(policy, &default_policy.list_head, list_head) {
 		if (strcmp(policy->name, name) == 0) {
 			current_policy = policy;
+			policy_generation++;
 			pr_info("set eviction policy to '%s'\n", name);
 			return 0;
 		}
@@ -149,36 +171,223 @@ int set_eviction_policy(const char *name)
 	return -EINVAL;
 }
 
-// MARK: - Helper functions
+// MARK: - Background eviction
+
+/*
+ * Exact number of free blocks of the partition not reserved by delayed writes,
+ * for the slow paths
+ */
+static uint32_t nr_free_blocks(struct ouichefs_sb_info *sbi)
+{
+	return max_t(s64, percpu_counter_sum(&sbi->free_blocks) -
+				  percpu_counter_sum(&sbi->reserved_blocks),
+		     0);
+}
+
+/* Percentage of available blocks of the partition, approximate but cheap */
+static int percent_free(struct ouichefs_sb_info *sbi)
+{
+	s64 free = percpu_counter_read(&sbi->free_blocks) -
+		   percpu_counter_read(&sbi->reserved_blocks);
+
+	return free > 0 ? 100ULL * free / sbi->nr_blocks : 0;
+}
 
 /**
- * traverse_dir - Recursively traverses a directory and performs actions on each directory node and
- * file leaf.
+ * ouichefs_reclaim - Free some blocks of a partition with the current policy
  *
- * @sb: The super block of the file system.
- * @dir: The ouichefs block to traverse.
- * @dir_node: The traverse node representing the current directory.
- * @node_action_before: The function to be called before traversing a subdirectory node.
- * @node_action_after: The function to be called after traversing a subdirectory node.
- * @leaf_action: The function to be called for each leaf.
- * @data: Additional data to be passed to the action functions.
+ * @sb: The super block of the partition to clean.
+ * @nr_blocks: The number of blocks to free.
  *
- * This function recursively traverses a directory and performs actions on each node and leaf.
- * It starts from the given directory block and traverses all subdirectories and files within.
- * The provided action functions are called at specific points during the traversal.
- * The node_action_before function is called before traversing a directory node.
- * The node_action_after function is called after traversing a directory node.
- * The leaf_action function is called for each leaf node (file).
+ * This function calls the reclaim() function of the current policy, which
+ * frees the blocks in a single pass. Policies without it get their
+ * clean_partition() function called until enough blocks are free, or until it
+ * cannot free any more.
+ *
+ * Return: the number of blocks freed, or a negative error code.
  */
-void traverse_dir(struct super_block *sb, struct ouichefs_dir_block *dir,
-		  struct traverse_node *dir_node,
-		  void (*node_action_before)(struct traverse_node *parent,
-					     void *data),
-		  void (*node_action_after)(struct traverse_node *parent,
-					    void *data),
-		  void (*leaf_action)(struct traverse_node *parent,
-				      struct traverse_node *child, void *data),
-		  void *data)
+int ouichefs_reclaim(struct super_block *sb, uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t nr_free, prev, cur;
+
+	if (current_policy->reclaim)
+		return current_policy->reclaim(sb, nr_blocks);
+
+	nr_free = cur = nr_free_blocks(sbi);
+	do {
+		prev = cur;
+		current_policy->clean_partition(sb);
+		cur = nr_free_blocks(sbi);
+	} while (cur > prev && cur - nr_free < nr_blocks);
+
+	return cur > nr_free ? cur - nr_free : 0;
+}
+EXPORT_SYMBOL(ouichefs_reclaim);
+
+/**
+ * evict_work_fn - Background eviction of a partition
+ *
+ * @work: The evict_work of the partition.
+ *
+ * This function asks the current policy to free enough blocks to reach
+ * eviction_high_watermark percent of free blocks (or at least
+ * trigger_threshold). Policies free large batches at once, it is only called
+ * again if the batch was not enough. It gives up as soon as the policy cannot
+ * free any block, the next write will kick it again.
+ */
+static void evict_work_fn(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(work, struct ouichefs_sb_info, evict_work);
+	int target = max(eviction_high_watermark, trigger_threshold);
+	uint32_t goal = DIV_ROUND_UP_ULL((uint64_t)sbi->nr_blocks * target, 100);
+	uint32_t nr_free;
+
+	pr_info("cleaning partition %s\n", sbi->sb->s_id);
+
+	/* Blocks reserved for growing files come back before evicting any */
+	ouichefs_discard_all_prealloc(sbi->sb);
+
+	while ((nr_free = nr_free_blocks(sbi)) < goal) {
+		if (ouichefs_reclaim(sbi->sb, goal - nr_free) <= 0)
+			break;
+	}
+
+	pr_info("free blocks: %u, total blocks: %u, percent free: %d\n",
+		nr_free_blocks(sbi), sbi->nr_blocks, percent_free(sbi));
+}
+
+/**
+ * ouichefs_init_eviction - Set up eviction for a partition
+ *
+ * @sb: The super block of the partition being mounted.
+ *
+ * Allocates the (still empty) victim index of the partition and prepares its
+ * background eviction worker.
+ *
+ * Return: 0 on success, -ENOMEM on failure.
+ */
+int ouichefs_init_eviction(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_victim_index *idx;
+
+	idx = kzalloc(sizeof(*idx), GFP_KERNEL);
+	if (!idx)
+		return -ENOMEM;
+	mutex_init(&idx->lock);
+	mutex_init(&idx->build_lock);
+	xa_init(&idx->files);
+	idx->tree = RB_ROOT_CACHED;
+
+	sbi->victims = idx;
+	sbi->sb = sb;
+	INIT_WORK(&sbi->evict_work, evict_work_fn);
+
+	return 0;
+}
+
+/**
+ * ouichefs_stop_eviction - Stop background eviction for a partition
+ *
+ * @sb: The super block of the partition being unmounted.
+ *
+ * Waits for a running eviction to finish. Must be called before the inodes of
+ * the partition are evicted.
+ */
+void ouichefs_stop_eviction(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (sbi)
+		cancel_work_sync(&sbi->evict_work);
+}
+
+/**
+ * ouichefs_release_eviction - Free the eviction state of a partition
+ *
+ * @sb: The super block of the partition being unmounted.
+ */
+void ouichefs_release_eviction(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_victim_index *idx = sbi->victims;
+	struct ouichefs_victim *v;
+	unsigned long ino;
+
+	if (!idx)
+		return;
+
+	xa_for_each(&idx->files, ino, v)
+		kfree(v);
+	xa_destroy(&idx->files);
+	kfree(idx);
+	sbi->victims = NULL;
+}
+
+/**
+ * ouichefs_trigger_eviction - Kick background eviction if space is running low
+ *
+ * @sb: The super block of the partition that was written to.
+ *
+ * This function is called after data has been written to a file. If less than
+ * trigger_threshold percent of the blocks of the partition are free, the
+ * eviction worker of the partition is queued. It does not wait for it.
+ */
+void ouichefs_trigger_eviction(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (percent_free(sbi) < trigger_threshold)
+		queue_work(system_unbound_wq, &sbi->evict_work);
+}
+
+/**
+ * ouichefs_wait_for_space - Make sure that some blocks are free
+ *
+ * @sb: The super block of the partition.
+ * @nr_blocks: The number of blocks that are needed.
+ *
+ * If less than nr_blocks blocks are free, give back the preallocation windows
+ * of the partition, then run the eviction worker and wait for it to complete.
+ * This is the only place where writers block on eviction.
+ *
+ * Return: 0 if nr_blocks blocks are free, -ENOSPC otherwise.
+ */
+int ouichefs_wait_for_space(struct super_block *sb, uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (has_free_blocks(sbi, nr_blocks))
+		return 0;
+
+	ouichefs_discard_all_prealloc(sb);
+	if (has_free_blocks(sbi, nr_blocks))
+		return 0;
+
+	queue_work(system_unbound_wq, &sbi->evict_work);
+	flush_work(&sbi->evict_work);
+
+	if (!has_free_blocks(sbi, nr_blocks))
+		return -ENOSPC;
+
+	return 0;
+}
+
+// MARK: - Helper functions
+
+/*
+ * Traverse the entries of a single directory block, see traverse_dir().
+ */
+static void traverse_bucket(
+	struct super_block *sb, struct ouichefs_dir_block *dir,
+	struct traverse_node *dir_node,
+	void (*node_action_before)(struct traverse_node *parent, void *data),
+	void (*node_action_after)(struct traverse_node *parent, void *data),
+	void (*leaf_action)(struct traverse_node *parent,
+			    struct traverse_node *child, void *data),
+	void *data)
 {
 	struct ouichefs_file *dir_file = dir_node->file;
 	struct inode *dir_inode = dir_node->inode;
@@ -190,7 +399,7 @@ void traverse_dir(struct super_block *sb, struct ouichefs_dir_block *dir,
 		f = &dir->files[i];
 
 		if (!f->inode)
-			break;
+			continue;
 
 		// for some reason no variation of ilookup / find_inode_* works, so after 3h of debugging we give up and just grab the inode from the disk, instead of cache
 		// inode = ilookup(sb, f->inode);
@@ -236,6 +445,61 @@ void traverse_dir(struct super_block *sb, struct ouichefs_dir_block *dir,
 		iput(inode);
 	}
 }
+
+/**
+ * traverse_dir - Recursively traverses a directory and performs actions on each directory node and
+ * file leaf.
+ *
+ * @sb: The super block of the file system.
+ * @dir: The index block of the directory to traverse.
+ * @dir_node: The traverse node representing the current directory.
+ * @node_action_before: The function to be called before traversing a subdirectory node.
+ * @node_action_after: The function to be called after traversing a subdirectory node.
+ * @leaf_action: The function to be called for each leaf.
+ * @data: Additional data to be passed to the action functions.
+ *
+ * This function recursively traverses a directory and performs actions on each node and leaf.
+ * It starts from the given directory block and traverses all subdirectories and files within.
+ * The provided action functions are called at specific points during the traversal.
+ * The node_action_before function is called before traversing a directory node.
+ * The node_action_after function is called after traversing a directory node.
+ * The leaf_action function is called for each leaf node (file).
+ * The entries of a hashed directory are read from each of its buckets.
+ */
+void traverse_dir(struct super_block *sb, struct ouichefs_dir_block *dir,
+		  struct traverse_node *dir_node,
+		  void (*node_action_before)(struct traverse_node *parent,
+					     void *data),
+		  void (*node_action_after)(struct traverse_node *parent,
+					    void *data),
+		  void (*leaf_action)(struct traverse_node *parent,
+				      struct traverse_node *child, void *data),
+		  void *data)
+{
+	if (OUICHEFS_HAS_FEATURE(sb, HASHED_DIRS)) {
+		struct ouichefs_dir_index_block *dindex =
+			(struct ouichefs_dir_index_block *)dir;
+		struct ouichefs_dir_block *bucket = NULL;
+		struct buffer_head *bh = NULL;
+
+		for (int b = 0; b < OUICHEFS_DIR_BUCKETS; b++) {
+			if (!dindex->buckets[b])
+				continue;
+			bh = sb_bread(sb, dindex->buckets[b]);
+			if (!bh)
+				return;
+			bucket = (struct ouichefs_dir_block *)bh->b_data;
+			traverse_bucket(sb, bucket, dir_node,
+					node_action_before, node_action_after,
+					leaf_action, data);
+			brelse(bh);
+		}
+		return;
+	}
+
+	traverse_bucket(sb, dir, dir_node, node_action_before,
+			node_action_after, leaf_action, data);
+}
 EXPORT_SYMBOL(traverse_dir);
 
 /**
@@ -345,3 +609,484 @@ int ouichefs_file_in_use_legacy(struct inode *inode)
 
 	return inode_used;
 }
+
+// MARK: - Victim index
+
+/* Copy the eviction keys of inode into v */
+static void victim_fill(struct ouichefs_victim *v, struct inode *inode)
+{
+	v->atime = inode->i_atime;
+	v->mtime = inode->i_mtime;
+	v->ctime = inode->i_ctime;
+	v->size = i_size_read(inode);
+}
+
+/* Insert v in the victim tree. Must hold idx->lock. */
+static void victim_queue(struct ouichefs_victim_index *idx,
+			 struct ouichefs_victim *v)
+{
+	struct rb_node **link = &idx->tree.rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true;
+
+	if (!idx->compare || v->users)
+		return;
+
+	while (*link) {
+		parent = *link;
+		if (idx->compare(v, rb_entry(parent, struct ouichefs_victim,
+					     node)) < 0) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&v->node, parent, link);
+	rb_insert_color_cached(&v->node, &idx->tree, leftmost);
+}
+
+/* Remove v from the victim tree if it is in. Must hold idx->lock. */
+static void victim_dequeue(struct ouichefs_victim_index *idx,
+			   struct ouichefs_victim *v)
+{
+	if (RB_EMPTY_NODE(&v->node))
+		return;
+	rb_erase_cached(&v->node, &idx->tree);
+	RB_CLEAR_NODE(&v->node);
+}
+
+/*
+ * Re-sort the victim tree if the current policy changed since it was built.
+ * Must hold idx->lock.
+ */
+static void victim_sort(struct ouichefs_victim_index *idx)
+{
+	struct ouichefs_victim *v;
+	unsigned long ino;
+
+	if (idx->generation == policy_generation)
+		return;
+
+	idx->tree = RB_ROOT_CACHED;
+	idx->compare = current_policy->compare;
+	idx->generation = policy_generation;
+
+	xa_for_each(&idx->files, ino, v) {
+		RB_CLEAR_NODE(&v->node);
+		victim_queue(idx, v);
+	}
+}
+
+/* Drop v from the index and free it. Must hold idx->lock. */
+static void victim_drop(struct ouichefs_victim_index *idx,
+			struct ouichefs_victim *v)
+{
+	victim_dequeue(idx, v);
+	xa_erase(&idx->files, v->ino);
+	kfree(v);
+}
+
+/* Start tracking the regular file inode, located in directory parent */
+static void victim_insert(struct ouichefs_victim_index *idx,
+			  struct inode *inode, unsigned long parent)
+{
+	struct ouichefs_victim *v;
+
+	if (!S_ISREG(inode->i_mode))
+		return;
+
+	v = kzalloc(sizeof(*v), GFP_NOFS);
+	if (!v)
+		return;
+	v->ino = inode->i_ino;
+	v->parent = parent;
+	/* Best effort for files opened before the index was built */
+	v->users = ouichefs_file_in_use(inode);
+	RB_CLEAR_NODE(&v->node);
+
+	mutex_lock(&idx->lock);
+	/* Not tracking yet, or already known */
+	if (!idx->active || xa_insert(&idx->files, v->ino, v, GFP_NOFS)) {
+		mutex_unlock(&idx->lock);
+		kfree(v);
+		return;
+	}
+	victim_sort(idx);
+	victim_fill(v, inode);
+	victim_queue(idx, v);
+	mutex_unlock(&idx->lock);
+}
+
+static void build_leaf_action(struct traverse_node *parent,
+			      struct traverse_node *child, void *data)
+{
+	victim_insert(data, child->inode, parent->inode->i_ino);
+}
+
+/*
+ * Build the victim index of a partition by walking the whole file tree once.
+ * Afterwards, the index is kept up to date by the filesystem operations.
+ */
+static int victim_build(struct super_block *sb)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(sb)->victims;
+	struct inode *root = d_inode(sb->s_root);
+	struct ouichefs_file root_file = {
+		.filename = "/",
+		.inode = root->i_ino,
+	};
+	struct traverse_node root_node = {
+		.file = &root_file,
+		.inode = root,
+	};
+	struct buffer_head *bh;
+	int ret = 0;
+
+	if (READ_ONCE(idx->active))
+		return 0;
+
+	mutex_lock(&idx->build_lock);
+	if (idx->active)
+		goto unlock;
+
+	bh = sb_bread(sb, OUICHEFS_INODE(root)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto unlock;
+	}
+
+	/* From now on, new files are added by ouichefs_create() */
+	mutex_lock(&idx->lock);
+	idx->active = true;
+	mutex_unlock(&idx->lock);
+
+	traverse_dir(sb, (struct ouichefs_dir_block *)bh->b_data, &root_node,
+		     NULL, NULL, build_leaf_action, idx);
+	brelse(bh);
+
+	pr_info("built victim index of %s\n", sb->s_id);
+
+unlock:
+	mutex_unlock(&idx->build_lock);
+
+	return ret;
+}
+
+/**
+ * ouichefs_victim_add - Track a newly created file
+ *
+ * @dir: The directory the file was created in.
+ * @inode: The inode of the new file.
+ */
+void ouichefs_victim_add(struct inode *dir, struct inode *inode)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(dir->i_sb)->victims;
+
+	victim_insert(idx, inode, dir->i_ino);
+}
+
+/**
+ * ouichefs_victim_update - Update the eviction keys of a file
+ *
+ * @inode: The inode that was dirtied.
+ *
+ * Called whenever an inode is dirtied, which covers accesses, writes and
+ * changes. Repositions the file in the victim tree.
+ */
+void ouichefs_victim_update(struct inode *inode)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(inode->i_sb)->victims;
+	struct ouichefs_victim *v;
+
+	if (!idx || !S_ISREG(inode->i_mode) || !READ_ONCE(idx->active))
+		return;
+
+	mutex_lock(&idx->lock);
+	v = xa_load(&idx->files, inode->i_ino);
+	if (v) {
+		victim_sort(idx);
+		victim_dequeue(idx, v);
+		victim_fill(v, inode);
+		victim_queue(idx, v);
+	}
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_victim_move - Record the new directory of a renamed file
+ *
+ * @inode: The renamed inode.
+ * @new_dir: The directory it was moved to.
+ */
+void ouichefs_victim_move(struct inode *inode, struct inode *new_dir)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(inode->i_sb)->victims;
+	struct ouichefs_victim *v;
+
+	if (!READ_ONCE(idx->active))
+		return;
+
+	mutex_lock(&idx->lock);
+	v = xa_load(&idx->files, inode->i_ino);
+	if (v)
+		v->parent = new_dir->i_ino;
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_victim_forget - Stop tracking a file
+ *
+ * @inode: The inode that is being removed.
+ */
+void ouichefs_victim_forget(struct inode *inode)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(inode->i_sb)->victims;
+	struct ouichefs_victim *v;
+
+	if (!READ_ONCE(idx->active))
+		return;
+
+	mutex_lock(&idx->lock);
+	v = xa_load(&idx->files, inode->i_ino);
+	if (v)
+		victim_drop(idx, v);
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_victim_open - Take a file out of the victim tree while it is open
+ *
+ * @inode: The inode being opened.
+ */
+void ouichefs_victim_open(struct inode *inode)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(inode->i_sb)->victims;
+	struct ouichefs_victim *v;
+
+	if (!READ_ONCE(idx->active))
+		return;
+
+	mutex_lock(&idx->lock);
+	v = xa_load(&idx->files, inode->i_ino);
+	if (v && !v->users++)
+		victim_dequeue(idx, v);
+	mutex_unlock(&idx->lock);
+}
+
+/**
+ * ouichefs_victim_release - Put a file back in the victim tree on last close
+ *
+ * @inode: The inode being released.
+ */
+void ouichefs_victim_release(struct inode *inode)
+{
+	struct ouichefs_victim_index *idx = OUICHEFS_SB(inode->i_sb)->victims;
+	struct ouichefs_victim *v;
+
+	if (!READ_ONCE(idx->active))
+		return;
+
+	mutex_lock(&idx->lock);
+	v = xa_load(&idx->files, inode->i_ino);
+	/* users may already be 0 if the file was opened before the build */
+	if (v && v->users && !--v->users) {
+		victim_sort(idx);
+		victim_fill(v, inode);
+		victim_queue(idx, v);
+	}
+	mutex_unlock(&idx->lock);
+}
+
+/*
+ * Remove child from parent like an unlink() would, with the directory locked.
+ * Files that are locked by someone else are left alone, their owner might be
+ * waiting for us.
+ */
+static int victim_remove(struct inode *parent, struct inode *child)
+{
+	int ret = -EBUSY;
+
+	inode_lock_nested(parent, I_MUTEX_PARENT);
+	if (inode_trylock(child)) {
+		ret = ouichefs_remove_file(parent, child);
+		inode_unlock(child);
+	}
+	inode_unlock(parent);
+
+	return ret;
+}
+
+/* A file picked for eviction, with a reference to its inode once checked */
+struct victim_pick {
+	struct inode *inode;
+	unsigned long ino;
+	unsigned long parent;
+};
+
+/*
+ * Copy up to max files from the left of the victim tree, until they hold at
+ * least nr_blocks blocks. Must hold idx->lock.
+ * Return: the number of files picked.
+ */
+static int victim_pick(struct ouichefs_victim_index *idx,
+		       struct victim_pick *picks, int max, uint32_t nr_blocks)
+{
+	struct ouichefs_victim *v;
+	struct rb_node *node;
+	uint64_t blocks = 0;
+	int nr = 0;
+
+	victim_sort(idx);
+	for (node = rb_first_cached(&idx->tree);
+	     node && nr < max && blocks < nr_blocks; node = rb_next(node)) {
+		v = rb_entry(node, struct ouichefs_victim, node);
+
+		picks[nr].inode = NULL;
+		picks[nr].ino = v->ino;
+		picks[nr].parent = v->parent;
+		nr++;
+
+		/* Data blocks and index block */
+		blocks += DIV_ROUND_UP(v->size, OUICHEFS_BLOCK_SIZE) + 1;
+	}
+
+	return nr;
+}
+
+/*
+ * Get the inodes of the nr files picked. They may be read from disk, so
+ * idx->lock is only taken to take the files that are gone or in use out of
+ * the tree, and out of picks. Their number is returned in skipped.
+ * Return: the number of files left in picks.
+ */
+static int victim_check(struct super_block *sb,
+			struct ouichefs_victim_index *idx,
+			struct victim_pick *picks, int nr, int *skipped)
+{
+	struct ouichefs_victim *v;
+	struct inode *inode;
+	int i, kept = 0;
+	bool gone;
+
+	*skipped = 0;
+	for (i = 0; i < nr; i++) {
+		inode = ouichefs_iget(sb, picks[i].ino);
+		if (IS_ERR(inode))
+			continue;
+
+		gone = !S_ISREG(inode->i_mode) || !inode->i_nlink;
+		if (gone || ouichefs_file_in_use(inode)) {
+			mutex_lock(&idx->lock);
+			v = xa_load(&idx->files, picks[i].ino);
+			if (v && gone) {
+				/* The file is gone, drop its stale entry */
+				victim_drop(idx, v);
+			} else if (v && !v->users) {
+				/* Opened before the index was built */
+				victim_dequeue(idx, v);
+				v->users = 1;
+			}
+			mutex_unlock(&idx->lock);
+			iput(inode);
+			(*skipped)++;
+			continue;
+		}
+
+		picks[kept].inode = inode;
+		picks[kept].parent = picks[i].parent;
+		kept++;
+	}
+
+	return kept;
+}
+
+/**
+ * ouichefs_evict_victims - Evict files from the left of the victim index
+ *
+ * @sb: The super block of the partition to clean.
+ * @nr_blocks: The number of blocks to free.
+ *
+ * This function builds the victim index of the partition if needed, then
+ * picks, in the order of the current policy, files that are not in use until
+ * they hold nr_blocks blocks (at most OUICHEFS_EVICT_BATCH files), and removes
+ * them all. The index is only walked once for the whole batch, and open files
+ * are not in it, so the victims are usually the leftmost entries. Their
+ * inodes are read without holding the index lock.
+ *
+ * Return: the number of blocks freed, -ENOENT if there is no file to evict, or
+ * another negative error code on failure.
+ */
+int ouichefs_evict_victims(struct super_block *sb, uint32_t nr_blocks)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_victim_index *idx = sbi->victims;
+	struct victim_pick *picks;
+	struct inode *parent;
+	uint32_t nr_free = nr_free_blocks(sbi);
+	int i, nr, skipped, ret;
+
+	ret = victim_build(sb);
+	if (ret)
+		return ret;
+
+	picks = kmalloc_array(OUICHEFS_EVICT_BATCH, sizeof(*picks), GFP_KERNEL);
+	if (!picks)
+		return -ENOMEM;
+
+	/* Files taken out of the tree leave room for the next ones */
+	do {
+		mutex_lock(&idx->lock);
+		nr = victim_pick(idx, picks, OUICHEFS_EVICT_BATCH, nr_blocks);
+		mutex_unlock(&idx->lock);
+		nr = victim_check(sb, idx, picks, nr, &skipped);
+	} while (!nr && skipped);
+
+	if (!nr) {
+		pr_info("No file to delete\n");
+		ret = -ENOENT;
+		goto free;
+	}
+
+	for (i = 0; i < nr; i++) {
+		parent = ouichefs_iget(sb, picks[i].parent);
+		if (IS_ERR(parent)) {
+			iput(picks[i].inode);
+			continue;
+		}
+
+		pr_info("Removing file: %lu in directory: %lu\n",
+			picks[i].inode->i_ino, parent->i_ino);
+
+		if (victim_remove(parent, picks[i].inode))
+			pr_err("Failed to remove file\n");
+
+		iput(parent);
+		iput(picks[i].inode);
+	}
+
+	ret = max_t(int, nr_free_blocks(sbi) - nr_free, 0);
+free:
+	kfree(picks);
+
+	return ret;
+}
+EXPORT_SYMBOL(ouichefs_evict_victims);
+
+/**
+ * ouichefs_evict_victim - Evict the first file of the victim index
+ *
+ * @sb: The super block of the partition to clean.
+ *
+ * Same as ouichefs_evict_victims(), for a single file.
+ *
+ * Return: 0 on success, -ENOENT if there is no file to evict, or another
+ * negative error code on failure.
+ */
+int ouichefs_evict_victim(struct super_block *sb)
+{
+	int ret = ouichefs_evict_victims(sb, 1);
+
+	return ret < 0 ? ret : 0;
+}
+EXPORT_SYMBOL(ouichefs_evict_victim);
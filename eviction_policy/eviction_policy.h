@@ -8,10 +8,44 @@
 #define _EVICTION_POLICY_H
 
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/xarray.h>
 #include "../ouichefs.h"
 
 #define POLICY_NAME_LEN 32
 
+/*
+ * A regular file as tracked by the victim index of a partition. The keys are
+ * kept up to date when the inode is dirtied (access, write, change).
+ */
+struct ouichefs_victim {
+	struct rb_node node; /* In the victim tree, ordered by the policy */
+	unsigned long ino; /* Inode number of the file */
+	unsigned long parent; /* Inode number of its directory */
+	struct timespec64 atime;
+	struct timespec64 mtime;
+	struct timespec64 ctime;
+	loff_t size;
+	unsigned int users; /* Open files are kept out of the tree */
+};
+
+/*
+ * Per partition index of the regular files, ordered with the compare()
+ * function of the current policy. It is built on the first eviction and then
+ * maintained incrementally.
+ */
+struct ouichefs_victim_index {
+	struct mutex lock; /* Protects everything below */
+	struct xarray files; /* Inode number -> struct ouichefs_victim */
+	struct rb_root_cached tree; /* Leftmost is the best victim */
+	int (*compare)(const struct ouichefs_victim *a,
+		       const struct ouichefs_victim *b);
+	unsigned int generation; /* Policy generation the tree is sorted for */
+	bool active; /* Files are being tracked */
+	struct mutex build_lock; /* Serializes the initial build */
+};
+
 struct ouichefs_eviction_policy {
 	char name[POLICY_NAME_LEN];
 
@@ -32,6 +66,23 @@ struct ouichefs_eviction_policy {
 	int (*clean_dir)(struct super_block *sb, struct inode *parent,
 			 struct ouichefs_file *files);
 
+	/**
+	 * Optional. Orders the victim index of each partition: it should
+	 * return a negative value if file a should be evicted before file b.
+	 * Policies providing it can pick victims in O(log n) with
+	 * ouichefs_evict_victim() instead of walking the whole partition.
+	 */
+	int (*compare)(const struct ouichefs_victim *a,
+		       const struct ouichefs_victim *b);
+
+	/**
+	 * Optional. Frees at least nr_blocks blocks of the partition in a
+	 * single pass, e.g. by collecting a batch of victims at once, and
+	 * returns the number of blocks freed. Without it, clean_partition() is
+	 * called once per file.
+	 */
+	int (*reclaim)(struct super_block *sb, uint32_t nr_blocks);
+
 	struct list_head list_head;
 };
 
@@ -42,6 +93,15 @@ int set_eviction_policy(const char *name);
 
 extern struct ouichefs_eviction_policy *current_policy;
 
+// background eviction
+
+int ouichefs_init_eviction(struct super_block *sb);
+int ouichefs_reclaim(struct super_block *sb, uint32_t nr_blocks);
+void ouichefs_stop_eviction(struct super_block *sb);
+void ouichefs_release_eviction(struct super_block *sb);
+void ouichefs_trigger_eviction(struct super_block *sb);
+int ouichefs_wait_for_space(struct super_block *sb, uint32_t nr_blocks);
+
 // helpers for traversing the filesystem
 
 struct traverse_node {
@@ -63,6 +123,20 @@ int ouichefs_remove_file(struct inode *parent, struct inode *child);
 
 int ouichefs_file_in_use(struct inode *inode);
 
+// victim index
+
+void ouichefs_victim_add(struct inode *dir, struct inode *inode);
+void ouichefs_victim_update(struct inode *inode);
+void ouichefs_victim_move(struct inode *inode, struct inode *new_dir);
+void ouichefs_victim_forget(struct inode *inode);
+void ouichefs_victim_open(struct inode *inode);
+void ouichefs_victim_release(struct inode *inode);
+/* Maximum number of files removed by one ouichefs_evict_victims() call */
+#define OUICHEFS_EVICT_BATCH 64
+
+int ouichefs_evict_victim(struct super_block *sb);
+int ouichefs_evict_victims(struct super_block *sb, uint32_t nr_blocks);
+
 /**
  * This variable is used in the eviction policy module to determine when to trigger eviction.
  * This is a percentage of the total blocks in the partition.
@@ -71,4 +145,10 @@ int ouichefs_file_in_use(struct inode *inode);
  */
 extern int trigger_threshold;
 
+/**
+ * Once triggered, background eviction frees files until this percentage of
+ * the blocks of the partition is free.
+ */
+extern int eviction_high_watermark;
+
 #endif /* _EVICTION_POLICY_H */
@@ -0,0 +1,470 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * In-memory index of the free extents of a partition, kept next to the free
+ * blocks bitmap. Every run of free blocks is in two rbtrees: one ordered by
+ * start block (to merge neighbours when a block is freed) and one ordered by
+ * length (to find the best fit for an allocation).
+ *
+ * Each allocation group has its own index, protected by the group lock like
+ * its part of the bitmap, and extents never span two groups. Updates are made
+ * with the lock held and can't sleep: if one fails to allocate, the index is
+ * flagged stale and rebuilt from the bitmap before it is next read. Rebuilds
+ * work on a copy of the bitmap and don't hold the lock while they walk it.
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+struct ouichefs_extent {
+	struct rb_node by_start;
+	struct rb_node by_len;
+	uint32_t start; /* First free block */
+	uint32_t len; /* Number of free blocks */
+};
+
+/* Number of copies of the bitmap indexed before giving up on a busy group */
+#define EXTENT_BUILD_TRIES 4
+
+static inline uint32_t extent_hist(uint32_t len)
+{
+	return min_t(uint32_t, ilog2(len), OUICHEFS_EXTENT_HIST - 1);
+}
+
+static void extent_link_start(struct ouichefs_extent_tree *tree,
+			      struct ouichefs_extent *ext)
+{
+	struct rb_node **link = &tree->by_start.rb_node, *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		if (ext->start < rb_entry(parent, struct ouichefs_extent,
+					  by_start)->start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&ext->by_start, parent, link);
+	rb_insert_color(&ext->by_start, &tree->by_start);
+}
+
+/* Extents are ordered by length, then by start for a deterministic best fit */
+static void extent_link_len(struct ouichefs_extent_tree *tree,
+			    struct ouichefs_extent *ext)
+{
+	struct rb_node **link = &tree->by_len.rb_node, *parent = NULL;
+	struct ouichefs_extent *cur;
+
+	while (*link) {
+		parent = *link;
+		cur = rb_entry(parent, struct ouichefs_extent, by_len);
+		if (ext->len < cur->len ||
+		    (ext->len == cur->len && ext->start < cur->start))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&ext->by_len, parent, link);
+	rb_insert_color(&ext->by_len, &tree->by_len);
+	tree->hist[extent_hist(ext->len)]++;
+}
+
+static void extent_unlink_len(struct ouichefs_extent_tree *tree,
+			      struct ouichefs_extent *ext)
+{
+	tree->hist[extent_hist(ext->len)]--;
+	rb_erase(&ext->by_len, &tree->by_len);
+}
+
+static int extent_insert(struct ouichefs_extent_tree *tree, uint32_t start,
+			 uint32_t len, gfp_t gfp)
+{
+	struct ouichefs_extent *ext;
+
+	ext = kmalloc(sizeof(*ext), gfp);
+	if (!ext)
+		return -ENOMEM;
+	ext->start = start;
+	ext->len = len;
+	extent_link_start(tree, ext);
+	extent_link_len(tree, ext);
+	tree->nr_extents++;
+
+	return 0;
+}
+
+static void extent_erase(struct ouichefs_extent_tree *tree,
+			 struct ouichefs_extent *ext)
+{
+	rb_erase(&ext->by_start, &tree->by_start);
+	extent_unlink_len(tree, ext);
+	tree->nr_extents--;
+	kfree(ext);
+}
+
+/* Change the length of ext, which must be re-sorted in by_len */
+static void extent_resize(struct ouichefs_extent_tree *tree,
+			  struct ouichefs_extent *ext, uint32_t start,
+			  uint32_t len)
+{
+	extent_unlink_len(tree, ext);
+	ext->start = start;
+	ext->len = len;
+	extent_link_len(tree, ext);
+}
+
+/* Return the last extent starting at or before bno, or NULL */
+static struct ouichefs_extent *extent_lookup(struct ouichefs_extent_tree *tree,
+					     uint32_t bno)
+{
+	struct rb_node *node = tree->by_start.rb_node;
+	struct ouichefs_extent *ext, *found = NULL;
+
+	while (node) {
+		ext = rb_entry(node, struct ouichefs_extent, by_start);
+		if (bno < ext->start) {
+			node = node->rb_left;
+		} else {
+			found = ext;
+			node = node->rb_right;
+		}
+	}
+
+	return found;
+}
+
+static void extent_clear(struct ouichefs_extent_tree *tree)
+{
+	struct ouichefs_extent *ext, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(ext, tmp, &tree->by_start,
+					     by_start)
+		kfree(ext);
+	tree->by_start = RB_ROOT;
+	tree->by_len = RB_ROOT;
+	tree->nr_extents = 0;
+	memset(tree->hist, 0, sizeof(tree->hist));
+}
+
+/* Return the free extents of the group of block bno */
+static struct ouichefs_extent_tree *extent_tree(struct ouichefs_sb_info *sbi,
+						uint32_t bno)
+{
+	return &sbi->groups[block_group(sbi, bno)].free_extents;
+}
+
+/* Index the free extents of the size bits of bitmap, block first is bit 0 */
+static int extent_index(struct ouichefs_extent_tree *tree,
+			const unsigned long *bitmap, unsigned long first,
+			unsigned long size)
+{
+	unsigned long start, end = 0;
+	int ret;
+
+	for (;;) {
+		start = find_next_bit(bitmap, size, end);
+		if (start >= size)
+			return 0;
+		end = find_next_zero_bit(bitmap, size, start);
+		ret = extent_insert(tree, first + start, end - start, GFP_NOFS);
+		if (ret)
+			return ret;
+	}
+}
+
+/*
+ * Rebuild the stale index of the loaded group g. The group lock is only held
+ * to copy the bitmap and to install the new index, which is thrown away if
+ * the bitmap changed in the meantime. After a few such races the index is
+ * left stale, and the next reader tries again. May sleep.
+ * Return 0 on success, or a negative error code.
+ */
+int ouichefs_build_extents(struct ouichefs_sb_info *sbi, uint32_t g)
+{
+	struct ouichefs_group *grp = &sbi->groups[g];
+	struct ouichefs_extent_tree *tree = &grp->free_extents;
+	struct ouichefs_extent_tree new;
+	unsigned long first = group_first_block(sbi, g);
+	unsigned long size = group_end_block(sbi, g) - first;
+	unsigned long *copy;
+	uint32_t gen;
+	int i, ret = -EAGAIN;
+
+	copy = bitmap_alloc(size, GFP_NOFS);
+	if (!copy)
+		return -ENOMEM;
+
+	for (i = 0; i < EXTENT_BUILD_TRIES; i++) {
+		spin_lock(&grp->lock);
+		if (!tree->stale) {
+			/* Someone else was faster */
+			spin_unlock(&grp->lock);
+			ret = 0;
+			break;
+		}
+		bitmap_copy(copy, grp->bitmap, size);
+		gen = tree->gen;
+		spin_unlock(&grp->lock);
+
+		memset(&new, 0, sizeof(new));
+		new.by_start = RB_ROOT;
+		new.by_len = RB_ROOT;
+		ret = extent_index(&new, copy, first, size);
+		if (ret) {
+			extent_clear(&new);
+			break;
+		}
+
+		spin_lock(&grp->lock);
+		if (tree->stale && tree->gen == gen) {
+			new.gen = gen;
+			swap(*tree, new);
+			ret = 0;
+		} else {
+			ret = -EAGAIN;
+		}
+		spin_unlock(&grp->lock);
+
+		/* Either the old index, or the one that lost the race */
+		extent_clear(&new);
+		if (!ret)
+			break;
+	}
+	bitmap_free(copy);
+
+	return ret;
+}
+
+void ouichefs_destroy_extents(struct ouichefs_sb_info *sbi)
+{
+	uint32_t g;
+
+	if (!sbi->groups)
+		return;
+
+	for (g = 0; g < sbi->nr_groups; g++)
+		extent_clear(&sbi->groups[g].free_extents);
+}
+
+/*
+ * Remove block bno, which was just allocated, from the free extents.
+ * Must hold the lock of the group of bno.
+ */
+void ouichefs_extent_alloc(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_extent_tree *tree = extent_tree(sbi, bno);
+	struct ouichefs_extent *ext;
+	uint32_t end;
+
+	tree->gen++;
+	if (tree->stale)
+		return;
+
+	ext = extent_lookup(tree, bno);
+	if (!ext || bno >= ext->start + ext->len) {
+		pr_warn("block %u is not in a free extent\n", bno);
+		return;
+	}
+	end = ext->start + ext->len;
+
+	if (ext->len == 1) {
+		extent_erase(tree, ext);
+	} else if (bno == ext->start) {
+		extent_resize(tree, ext, bno + 1, ext->len - 1);
+	} else if (bno == end - 1) {
+		extent_resize(tree, ext, ext->start, ext->len - 1);
+	} else {
+		/* Split in two, the tail gets a new extent */
+		extent_resize(tree, ext, ext->start, bno - ext->start);
+		if (extent_insert(tree, bno + 1, end - bno - 1, GFP_NOWAIT))
+			tree->stale = true;
+	}
+}
+
+/*
+ * Add the len blocks starting at start, which were just freed, to the free
+ * extents, merging them with their neighbours. They must all be in the same
+ * group, and the lock of that group must be held.
+ */
+void ouichefs_extent_free(struct ouichefs_sb_info *sbi, uint32_t start,
+			  uint32_t len)
+{
+	struct ouichefs_extent_tree *tree = extent_tree(sbi, start);
+	struct ouichefs_extent *prev, *next = NULL;
+	struct rb_node *node;
+	uint32_t end = start + len;
+
+	tree->gen++;
+	if (tree->stale)
+		return;
+
+	prev = extent_lookup(tree, start);
+	if (prev) {
+		if (start < prev->start + prev->len)
+			goto stale; /* Already free */
+		node = rb_next(&prev->by_start);
+	} else {
+		node = rb_first(&tree->by_start);
+	}
+	if (node) {
+		next = rb_entry(node, struct ouichefs_extent, by_start);
+		if (next->start < end)
+			goto stale; /* Already free */
+		if (next->start != end)
+			next = NULL;
+	}
+	if (prev && prev->start + prev->len != start)
+		prev = NULL;
+
+	if (prev && next) {
+		len += prev->len + next->len;
+		extent_erase(tree, next);
+		extent_resize(tree, prev, prev->start, len);
+	} else if (prev) {
+		extent_resize(tree, prev, prev->start, prev->len + len);
+	} else if (next) {
+		/* by_start order is kept, next stays after its predecessor */
+		extent_resize(tree, next, start, next->len + len);
+	} else if (extent_insert(tree, start, len, GFP_NOWAIT)) {
+		tree->stale = true;
+	}
+	return;
+
+stale:
+	/* The index does not match the bitmap, build it again */
+	extent_clear(tree);
+	tree->stale = true;
+}
+
+/*
+ * The bitmap of the group of block bno changed in a way the index can't
+ * follow, build it again. Must hold the lock of that group.
+ */
+void ouichefs_extent_invalidate(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_extent_tree *tree = extent_tree(sbi, bno);
+
+	tree->gen++;
+	tree->stale = true;
+}
+
+/*
+ * Return the smallest extent of tree of at least nr blocks, or the largest one
+ * if none is big enough. Return NULL if the tree is empty.
+ */
+static struct ouichefs_extent *extent_best_fit(struct ouichefs_extent_tree *tree,
+					       uint32_t nr)
+{
+	struct rb_node *node = tree->by_len.rb_node, *best = NULL;
+	struct ouichefs_extent *ext;
+
+	while (node) {
+		ext = rb_entry(node, struct ouichefs_extent, by_len);
+		if (ext->len >= nr) {
+			best = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	if (!best)
+		best = rb_last(&tree->by_len);
+
+	return best ? rb_entry(best, struct ouichefs_extent, by_len) : NULL;
+}
+
+/*
+ * Return the start of the smallest free extent of at least nr blocks, or of
+ * the largest one if none is big enough, and its length in len. Groups are
+ * searched from the one of the current CPU, the first one with a big enough
+ * extent wins. Stale indexes are rebuilt on the way, so this may sleep.
+ * Return 0 if there is no free extent.
+ */
+uint32_t ouichefs_extent_best_fit(struct ouichefs_sb_info *sbi, uint32_t nr,
+				  uint32_t *len)
+{
+	struct ouichefs_group *grp;
+	struct ouichefs_extent *ext;
+	uint32_t i, g = cpu_group(sbi), start = 0;
+
+	*len = 0;
+	for (i = 0; i < sbi->nr_groups; i++, g = (g + 1) % sbi->nr_groups) {
+		grp = &sbi->groups[g];
+		if (!READ_ONCE(grp->nr_free))
+			continue;
+
+		if (!READ_ONCE(grp->bitmap))
+			continue;
+		if (READ_ONCE(grp->free_extents.stale))
+			ouichefs_build_extents(sbi, g);
+
+		spin_lock(&grp->lock);
+		if (grp->free_extents.stale) {
+			spin_unlock(&grp->lock);
+			continue;
+		}
+		ext = extent_best_fit(&grp->free_extents, nr);
+		if (ext && ext->len > *len) {
+			*len = ext->len;
+			start = ext->start;
+		}
+		spin_unlock(&grp->lock);
+
+		if (*len >= nr)
+			break;
+	}
+
+	return start;
+}
+
+/*
+ * Fill stats with the number of free extents, the largest one, and a histogram
+ * of their lengths: hist[i] counts the extents of 2^i to 2^(i+1) - 1 blocks.
+ * Only the groups that are loaded are counted. The histogram is kept up to
+ * date by the index updates, so each group lock is only held to add it up.
+ */
+void ouichefs_extent_stats(struct ouichefs_sb_info *sbi,
+			   struct ouichefs_extent_stats *stats)
+{
+	struct ouichefs_group *grp;
+	struct ouichefs_extent_tree *tree;
+	struct rb_node *node;
+	uint32_t g;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		tree = &grp->free_extents;
+		if (!READ_ONCE(grp->bitmap))
+			continue;
+		if (READ_ONCE(tree->stale))
+			ouichefs_build_extents(sbi, g);
+
+		spin_lock(&grp->lock);
+		stats->nr_loaded++;
+		if (tree->stale) {
+			spin_unlock(&grp->lock);
+			continue;
+		}
+		stats->nr_extents += tree->nr_extents;
+		node = rb_last(&tree->by_len);
+		if (node)
+			stats->largest = max(stats->largest,
+					     rb_entry(node, struct ouichefs_extent,
+						      by_len)->len);
+		for (i = 0; i < OUICHEFS_EXTENT_HIST; i++)
+			stats->hist[i] += tree->hist[i];
+		spin_unlock(&grp->lock);
+	}
+}
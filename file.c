@@ -17,57 +17,513 @@
 #include "bitmap.h"
 #include "eviction_policy/eviction_policy.h"
 
+/*
+ * Return the index block of a regular file. It is read from disk on first use
+ * and then stays pinned in the inode until ouichefs_drop_index() is called,
+ * so that mapping a block does not go through the buffer cache every time.
+ * Return NULL if the index block could not be read.
+ */
+struct ouichefs_file_index_block *ouichefs_get_index(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh = READ_ONCE(ci->index_bh);
+
+	if (!bh) {
+		/* File was removed, it has no index block anymore */
+		if (!ci->index_block)
+			return NULL;
+		bh = sb_bread(inode->i_sb, ci->index_block);
+		if (!bh)
+			return NULL;
+		/* Somebody else cached it in the meantime, use theirs */
+		if (cmpxchg(&ci->index_bh, NULL, bh)) {
+			brelse(bh);
+			bh = READ_ONCE(ci->index_bh);
+		}
+	}
+
+	return (struct ouichefs_file_index_block *)bh->b_data;
+}
+
+/*
+ * Release the cached index block of inode. Must be called before the index
+ * block is freed, and when the inode is evicted.
+ */
+void ouichefs_drop_index(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	brelse(xchg(&ci->index_bh, NULL));
+}
+
+/*
+ * A growing file reserves a window of contiguous free blocks right after the
+ * block it just allocated, and its next allocations are carved out of it, so
+ * that files appended to concurrently don't end up interleaved on disk.
+ * Reserved blocks are only marked used in the in-memory bitmap: windows are
+ * given back when the file is closed, under space pressure, and before the
+ * bitmap is written to disk.
+ * The window doubles each time the file uses it up (up to
+ * OUICHEFS_PREALLOC_MAX blocks), and is halved when more than half of it is
+ * given back unused.
+ *
+ * Lock order: sbi->prealloc_lock, ci->prealloc_lock, then the group locks.
+ */
+
+/*
+ * Give back the window of ci. Must hold ci->prealloc_lock. Its blocks were
+ * taken with get_free_block_at(), so their groups are loaded and giving them
+ * back does not sleep.
+ */
+static void prealloc_put(struct ouichefs_sb_info *sbi,
+			 struct ouichefs_inode_info *ci)
+{
+	if (!ci->prealloc_len)
+		return;
+
+	if (ci->prealloc_len > ci->prealloc_size / 2)
+		ci->prealloc_size = max_t(uint32_t, ci->prealloc_size / 2,
+					  OUICHEFS_PREALLOC_MIN);
+	put_loaded_blocks(sbi, ci->prealloc_start, ci->prealloc_len);
+	ci->prealloc_start += ci->prealloc_len;
+	ci->prealloc_len = 0;
+}
+
+/*
+ * Take the first block of the window of inode if it is goal, or if there is
+ * no goal. A window that does not follow the file anymore is given back.
+ * Return the block, 0 if it must be allocated elsewhere.
+ */
+static uint32_t prealloc_take(struct inode *inode, uint32_t goal)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t bno = 0;
+
+	spin_lock(&ci->prealloc_lock);
+	if (!ci->prealloc_len)
+		goto unlock;
+	if (goal && goal != ci->prealloc_start) {
+		prealloc_put(sbi, ci);
+		goto unlock;
+	}
+
+	bno = ci->prealloc_start++;
+	if (!--ci->prealloc_len)
+		ci->prealloc_size = min_t(uint32_t, ci->prealloc_size * 2,
+					  OUICHEFS_PREALLOC_MAX);
+unlock:
+	spin_unlock(&ci->prealloc_lock);
+
+	return bno;
+}
+
+/*
+ * Reserve up to max free blocks starting at start as the window of inode, if
+ * it has none. The window stops at the first used block.
+ */
+static void prealloc_fill(struct inode *inode, uint32_t start, uint32_t max)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t len;
+
+	if (READ_ONCE(ci->prealloc_len))
+		return;
+
+	spin_lock(&sbi->prealloc_lock);
+	spin_lock(&ci->prealloc_lock);
+	if (ci->prealloc_len)
+		goto unlock;
+
+	max = min(max, ci->prealloc_size);
+	for (len = 0; len < max; len++)
+		if (!get_free_block_at(sbi, start + len))
+			break;
+	ci->prealloc_start = start;
+	ci->prealloc_len = len;
+	if (len && list_empty(&ci->prealloc_list))
+		list_add_tail(&ci->prealloc_list, &sbi->prealloc_list);
+unlock:
+	spin_unlock(&ci->prealloc_lock);
+	spin_unlock(&sbi->prealloc_lock);
+}
+
+/*
+ * Give back the preallocation window of inode. Called when the file is closed,
+ * removed, or evicted from the inode cache.
+ */
+void ouichefs_discard_prealloc(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (list_empty(&ci->prealloc_list))
+		return;
+
+	spin_lock(&sbi->prealloc_lock);
+	spin_lock(&ci->prealloc_lock);
+	prealloc_put(sbi, ci);
+	list_del_init(&ci->prealloc_list);
+	spin_unlock(&ci->prealloc_lock);
+	spin_unlock(&sbi->prealloc_lock);
+}
+
+/*
+ * Give back the preallocation windows of all the files of the partition. Called
+ * when free blocks are running low, and before the bitmap is written to disk.
+ */
+void ouichefs_discard_all_prealloc(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci, *tmp;
+
+	spin_lock(&sbi->prealloc_lock);
+	list_for_each_entry_safe(ci, tmp, &sbi->prealloc_list, prealloc_list) {
+		spin_lock(&ci->prealloc_lock);
+		prealloc_put(sbi, ci);
+		spin_unlock(&ci->prealloc_lock);
+		list_del_init(&ci->prealloc_list);
+	}
+	spin_unlock(&sbi->prealloc_lock);
+}
+
+/*
+ * Return the length of the run of up to max_blocks blocks of index from iblock
+ * that are either physically contiguous, or all holes.
+ */
+static unsigned int index_run(struct ouichefs_file_index_block *index,
+			      sector_t iblock, unsigned int max_blocks)
+{
+	uint32_t bno = index->blocks[iblock];
+	unsigned int i;
+
+	for (i = 1; i < max_blocks; i++)
+		if (index->blocks[iblock + i] != (bno ? bno + i : 0))
+			break;
+
+	return i;
+}
+
+/*
+ * Fill the hole of inode at iblock, with up to max_blocks blocks, like
+ * ouichefs_map_blocks(). The hole is checked again, somebody else may have
+ * filled it first. Must hold ci->alloc_lock.
+ */
+static int fill_hole(struct inode *inode,
+		     struct ouichefs_file_index_block *index, sector_t iblock,
+		     unsigned int max_blocks, uint32_t *bno, bool *new)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t goal = 0;
+	unsigned int i;
+
+	lockdep_assert_held(&ci->alloc_lock);
+
+	*new = false;
+	*bno = index->blocks[iblock];
+	if (*bno)
+		return index_run(index, iblock, max_blocks);
+
+	/*
+	 * Fill the hole. The first block comes from the preallocation window
+	 * of the file, or directly follows the previous block of the file (or
+	 * the index block for the first one) if it is free. Otherwise, runs of
+	 * several blocks go to the best fitting free extent, single blocks as
+	 * close as possible after the goal. The next blocks are only taken if
+	 * they directly follow the first one on disk.
+	 */
+	if (iblock && index->blocks[iblock - 1])
+		goal = index->blocks[iblock - 1] + 1;
+	else if (!iblock)
+		goal = ci->index_block + 1;
+	*bno = prealloc_take(inode, goal);
+	if (!*bno && goal)
+		*bno = get_free_block_at(sbi, goal);
+	if (!*bno && max_blocks > 1) {
+		uint32_t start, len;
+
+		start = ouichefs_extent_best_fit(sbi, max_blocks, &len);
+		if (start)
+			*bno = get_free_block_at(sbi, start);
+	}
+	if (!*bno)
+		*bno = get_free_block_near(sbi, goal);
+	if (!*bno) {
+		/* The free blocks left may all be reserved by windows */
+		ouichefs_discard_all_prealloc(inode->i_sb);
+		*bno = get_free_block_near(sbi, goal);
+	}
+	if (!*bno)
+		return -ENOSPC;
+	index->blocks[iblock] = *bno;
+	for (i = 1; i < max_blocks; i++) {
+		if (index->blocks[iblock + i])
+			break;
+		if (!prealloc_take(inode, *bno + i) &&
+		    !get_free_block_at(sbi, *bno + i))
+			break;
+		index->blocks[iblock + i] = *bno + i;
+	}
+
+	/* Reserve the blocks that follow for the next appends */
+	if (iblock + i < OUICHEFS_BLOCK_SIZE >> 2 && !index->blocks[iblock + i])
+		prealloc_fill(inode, *bno + i,
+			      (OUICHEFS_BLOCK_SIZE >> 2) - iblock - i);
+	/* Attach the index to the inode so that fsync() writes it too */
+	mark_buffer_dirty_inode(ci->index_bh, inode);
+	*new = true;
+
+	return i;
+}
+
+/*
+ * Map up to max_blocks blocks of inode starting at iblock. On success, *bno is
+ * set to the physical block backing iblock (0 for a hole) and the length of
+ * the run is returned: either physically contiguous blocks or consecutive
+ * holes. If create is true, a hole is filled with newly allocated blocks that
+ * we try to keep contiguous on disk, and *new is set.
+ * Return a negative error code on failure.
+ */
+int ouichefs_map_blocks(struct inode *inode, sector_t iblock,
+			unsigned int max_blocks, bool create, uint32_t *bno,
+			bool *new)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	int ret;
+
+	/* If block number exceeds filesize, fail */
+	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
+		return -EFBIG;
+	max_blocks = min_t(sector_t, max(max_blocks, 1U),
+			   (OUICHEFS_BLOCK_SIZE >> 2) - iblock);
+
+	/* Get the cached index block */
+	index = ouichefs_get_index(inode);
+	if (!index)
+		return -EIO;
+
+	*new = false;
+	*bno = index->blocks[iblock];
+
+	/*
+	 * Allocated: extend the run while the next blocks follow on disk.
+	 * Hole: report how far it goes if we are not asked to fill it.
+	 */
+	if (*bno || !create)
+		return index_run(index, iblock, max_blocks);
+
+	/* Writeback, page faults and direct I/O may fill holes concurrently */
+	mutex_lock(&ci->alloc_lock);
+	ret = fill_hole(inode, index, iblock, max_blocks, bno, new);
+	mutex_unlock(&ci->alloc_lock);
+
+	return ret;
+}
+
+/* Drop the delayed flags of nr blocks from iblock, and their reservations */
+static void undelay_blocks(struct inode *inode, sector_t iblock,
+			   unsigned int nr)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned int i, undelayed = 0;
+
+	for (i = 0; i < nr; i++)
+		undelayed += test_and_clear_bit(iblock + i, ci->delayed);
+	if (undelayed)
+		unreserve_blocks(OUICHEFS_SB(inode->i_sb), undelayed);
+}
+
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
  * true, allocate a new block on disk and map it.
+ * As many blocks as fit in bh_result->b_size are mapped at once if they are
+ * contiguous on disk, which lets mpage build large bios.
+ * A delayed block gets its place on disk here at writeback, along with the
+ * delayed blocks that follow it so that they end up contiguous.
  */
 static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
 				   struct buffer_head *bh_result, int create)
 {
-	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned int max_blocks = bh_result->b_size >> inode->i_blkbits;
+	unsigned int nr = max_blocks;
+	uint32_t bno;
+	bool new;
+	int ret;
+
+	if (create && iblock < OUICHEFS_BLOCK_SIZE >> 2 &&
+	    test_bit(iblock, ci->delayed))
+		nr = max_t(unsigned int, nr,
+			   find_next_zero_bit(ci->delayed,
+					      OUICHEFS_BLOCK_SIZE >> 2,
+					      iblock) - iblock);
+
+	ret = ouichefs_map_blocks(inode, iblock, nr, create, &bno, &new);
+	if (ret < 0)
+		return ret;
+
+	/* Delayed blocks of the run are on disk now, drop their reservation */
+	if (create && bno)
+		undelay_blocks(inode, iblock, ret);
+
+	/* Map the physical blocks to the given buffer_head */
+	if (bno) {
+		map_bh(bh_result, inode->i_sb, bno);
+		if (new)
+			set_buffer_new(bh_result);
+		/* The caller only cleans the aliases of the blocks it asked for */
+		if (new && ret > max_blocks)
+			clean_bdev_aliases(inode->i_sb->s_bdev, bno + max_blocks,
+					   ret - max_blocks);
+	}
+	bh_result->b_size = (size_t)min_t(unsigned int, ret, max_blocks)
+			    << inode->i_blkbits;
+
+	return 0;
+}
+
+/*
+ * get_block for buffered writes. Blocks already on disk are mapped, but holes
+ * are not allocated: a block is only reserved, and the buffer is left
+ * unmapped with BH_Delay set until ouichefs_file_get_block() gives it a place
+ * at writeback, once the final size of the file is known. Files removed
+ * before they are written back never touch the bitmap.
+ */
+static int ouichefs_da_get_block(struct inode *inode, sector_t iblock,
+				 struct buffer_head *bh, int create)
+{
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	int ret = 0, bno;
+	int ret;
 
-	/* If block number exceeds filesize, fail */
 	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
 		return -EFBIG;
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
+	index = ouichefs_get_index(inode);
+	if (!index)
 		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	if (index->blocks[iblock]) {
+		map_bh(bh, inode->i_sb, index->blocks[iblock]);
+		return 0;
+	}
 
-	/*
-	 * Check if iblock is already allocated. If not and create is true,
-	 * allocate it. Else, get the physical block number.
-	 */
-	if (index->blocks[iblock] == 0) {
-		if (!create) {
-			ret = 0;
-			goto brelse_index;
-		}
-		bno = get_free_block(sbi);
-		if (!bno) {
-			ret = -ENOSPC;
-			goto brelse_index;
-		}
-		index->blocks[iblock] = bno;
-	} else {
-		bno = index->blocks[iblock];
+	/* A block written before still holds its reservation */
+	if (!test_bit(iblock, ci->delayed)) {
+		ret = reserve_block(OUICHEFS_SB(inode->i_sb));
+		if (ret)
+			return ret;
+		set_bit(iblock, ci->delayed);
 	}
+	/* Zero what is not written, unless the buffer already has our data */
+	if (!buffer_uptodate(bh))
+		set_buffer_new(bh);
+	set_buffer_delay(bh);
+	/* Not mapped, but clean_bdev_bh_alias() looks at it: point past the disk */
+	bh->b_bdev = inode->i_sb->s_bdev;
+	bh->b_blocknr = ~(sector_t)0;
 
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
+	return 0;
+}
 
-brelse_index:
-	brelse(bh_index);
+/*
+ * Give back the reservations of the delayed blocks of inode from iblock on.
+ * Called once their pages are dropped from the page cache.
+ */
+void ouichefs_drop_delayed(struct inode *inode, sector_t iblock)
+{
+	if (iblock < OUICHEFS_BLOCK_SIZE >> 2)
+		undelay_blocks(inode, iblock,
+			       (OUICHEFS_BLOCK_SIZE >> 2) - iblock);
+}
 
-	return ret;
+/*
+ * Map the delayed buffers of the nr blocks of inode from iblock, which were
+ * just given their place on disk in index. Their pages are locked meanwhile.
+ * Must not hold ci->alloc_lock, which writeback takes with a page locked.
+ */
+static void map_delayed_buffers(struct inode *inode,
+				struct ouichefs_file_index_block *index,
+				sector_t iblock, unsigned int nr)
+{
+	unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+	struct buffer_head *head, *bh;
+	struct folio *folio;
+	pgoff_t pg;
+	sector_t block;
+
+	for (pg = iblock >> shift; pg <= (iblock + nr - 1) >> shift; pg++) {
+		folio = filemap_lock_folio(inode->i_mapping, pg);
+		if (IS_ERR(folio))
+			continue;
+		head = folio_buffers(folio);
+		/* Truncated in the meantime */
+		if (!head || folio->mapping != inode->i_mapping)
+			goto unlock;
+		bh = head;
+		block = (sector_t)pg << shift;
+		do {
+			if (block >= iblock && block < iblock + nr &&
+			    buffer_delay(bh) && index->blocks[block]) {
+				map_bh(bh, inode->i_sb, index->blocks[block]);
+				clear_buffer_delay(bh);
+			}
+			block++;
+		} while ((bh = bh->b_this_page) != head);
+unlock:
+		folio_unlock(folio);
+		folio_put(folio);
+	}
+}
+
+/*
+ * Give a place on disk to all the delayed blocks of inode, a whole run at
+ * once so that it ends up contiguous, and map their buffers. mpage only
+ * merges pages whose dirty buffers are all mapped: it would write the pages
+ * of delayed buffers one at a time. On failure, the pages left are written
+ * by block_write_full_page(), which allocates their blocks itself.
+ * Each run is found, allocated and undelayed under ci->alloc_lock, so that a
+ * concurrent writeback of the file doesn't allocate it a second time.
+ */
+static void ouichefs_map_delayed(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	sector_t iblock = 0, end;
+	uint32_t bno;
+	bool new;
+	int ret;
+
+	index = ouichefs_get_index(inode);
+	if (!index)
+		return;
+
+	for (;;) {
+		mutex_lock(&ci->alloc_lock);
+		iblock = find_next_bit(ci->delayed, OUICHEFS_BLOCK_SIZE >> 2,
+				       iblock);
+		if (iblock >= OUICHEFS_BLOCK_SIZE >> 2) {
+			mutex_unlock(&ci->alloc_lock);
+			return;
+		}
+		end = find_next_zero_bit(ci->delayed, OUICHEFS_BLOCK_SIZE >> 2,
+					 iblock);
+		ret = fill_hole(inode, index, iblock, end - iblock, &bno, &new);
+		if (ret > 0 && bno)
+			undelay_blocks(inode, iblock, ret);
+		mutex_unlock(&ci->alloc_lock);
+		if (ret < 0)
+			return;
+
+		if (new)
+			clean_bdev_aliases(inode->i_sb->s_bdev, bno, ret);
+		map_delayed_buffers(inode, index, iblock, ret);
+		iblock += ret;
+	}
+}
 }
 
 /*
@@ -88,17 +544,46 @@ static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
 	return block_write_full_page(page, ouichefs_file_get_block, wbc);
 }
 
+/*
+ * Called by the page cache to write back a range of dirty pages. Delayed
+ * blocks are given their place on disk first. Dirty folios are then walked in
+ * index order (honouring nr_to_write and range_cyclic) and pages backed by
+ * contiguous blocks are merged into a single bio. Pages that cannot be merged
+ * fall back to block_write_full_page().
+ */
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	ouichefs_map_delayed(mapping->host);
+
+	return mpage_writepages(mapping, wbc, ouichefs_file_get_block);
+}
+
+/*
+ * Called by the VFS for reads and writes on a file opened with O_DIRECT. Data
+ * is transferred between the user buffer and the disk without going through
+ * the page cache, blocks being mapped (and allocated for writes past the end
+ * of the file) by ouichefs_file_get_block(). Cached pages of the range are
+ * written back and invalidated by the caller beforehand.
+ */
+static ssize_t ouichefs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	return blockdev_direct_IO(iocb, inode, iter, ouichefs_file_get_block);
+}
+
 /*
  * Called by the VFS when a write() syscall occurs on file before writing the
  * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * complete and reserves the necessary blocks through block_write_begin(),
+ * they are only allocated at writeback.
  */
 static int ouichefs_write_begin(struct file *file,
 				struct address_space *mapping, loff_t pos,
 				unsigned int len, struct page **pagep,
 				void **fsdata)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
 	int err;
 	uint32_t nr_allocs = 0;
 
@@ -110,18 +595,14 @@ static int ouichefs_write_begin(struct file *file,
 		nr_allocs -= file->f_inode->i_blocks - 1;
 	else
 		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
-
-	/* prepare the write */
-	err = block_write_begin(mapping, pos, len, pagep,
-				ouichefs_file_get_block);
-	/* if this failed, reclaim newly allocated blocks */
-	if (err < 0) {
-		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
-		       __func__, __LINE__);
-	}
-	return err;
+	/* Only wait for eviction if there is not enough space right now */
+	err = ouichefs_wait_for_space(file->f_inode->i_sb, nr_allocs);
+	if (err)
+		return err;
+
+	/* prepare the write, nothing is allocated if it fails */
+	return block_write_begin(mapping, pos, len, pagep,
+				 ouichefs_da_get_block);
 }
 
 /*
@@ -137,8 +618,6 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 	struct inode *inode = file->f_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	int percent_free;
 
 	/* Complete the write() */
 	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
@@ -156,44 +635,35 @@ static int ouichefs_write_end(struct file *file, struct address_space *mapping,
 		/* If file is smaller than before, free unused blocks */
 		if (nr_blocks_old > inode->i_blocks) {
 			int i;
-			struct buffer_head *bh_index;
 			struct ouichefs_file_index_block *index;
 
 			/* Free unused blocks from page cache */
 			truncate_pagecache(inode, inode->i_size);
+			ouichefs_drop_delayed(inode, inode->i_blocks - 1);
 
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
+			/* Get index block to remove unused blocks */
+			index = ouichefs_get_index(inode);
+			if (!index) {
 				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
 				       file->f_path.dentry->d_name.name,
 				       nr_blocks_old - inode->i_blocks);
 				goto end;
 			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
 
+			mutex_lock(&ci->alloc_lock);
 			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
 			     i++) {
+				if (!index->blocks[i])
+					continue;
 				put_block(OUICHEFS_SB(sb), index->blocks[i]);
 				index->blocks[i] = 0;
 			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
+			mutex_unlock(&ci->alloc_lock);
+			mark_buffer_dirty(ci->index_bh);
 		}
 	}
 end:
-	percent_free = 100 * sbi->nr_free_blocks / sbi->nr_blocks;
-
-	pr_info("free blocks: %u, total blocks: %u, percent free: %d\n",
-		sbi->nr_free_blocks, sbi->nr_blocks, percent_free);
-
-	// after analyzing the whole fs, I think this is the best place to place this check
-	// i.e. to call the policy if some percentage of blocks are full
-	if (percent_free < trigger_threshold) {
-		pr_info("cleaning partition\n");
-		current_policy->clean_partition(sb);
-	}
+	ouichefs_trigger_eviction(sb);
 
 	return ret;
 }
@@ -201,11 +671,14 @@ end:
 const struct address_space_operations ouichefs_aops = {
 	.readahead = ouichefs_readahead,
 	.writepage = ouichefs_writepage,
+	.writepages = ouichefs_writepages,
 	.write_begin = ouichefs_write_begin,
-	.write_end = ouichefs_write_end
+	.write_end = ouichefs_write_end,
+	.direct_IO = ouichefs_direct_IO
 };
 
-static int ouichefs_open(struct inode *inode, struct file *file) {
+int ouichefs_open(struct inode *inode, struct file *file)
+{
 	bool wronly = (file->f_flags & O_WRONLY) != 0;
 	bool rdwr = (file->f_flags & O_RDWR) != 0;
 	bool trunc = (file->f_flags & O_TRUNC) != 0;
@@ -215,32 +688,79 @@ static int ouichefs_open(struct inode *inode, struct file *file) {
 		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
 		sector_t iblock;
 
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
+		/* Drop cached pages still mapped to the blocks we free */
+		truncate_pagecache(inode, 0);
+		ouichefs_drop_delayed(inode, 0);
+
+		/* Get the cached index block */
+		index = ouichefs_get_index(inode);
+		if (!index)
 			return -EIO;
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
 
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
+		/* Writeback may leave holes between allocated blocks */
+		mutex_lock(&ci->alloc_lock);
+		for (iblock = 0; iblock < OUICHEFS_BLOCK_SIZE >> 2; iblock++) {
+			if (!index->blocks[iblock])
+				continue;
 			put_block(sbi, index->blocks[iblock]);
 			index->blocks[iblock] = 0;
 		}
+		mutex_unlock(&ci->alloc_lock);
+		mark_buffer_dirty(ci->index_bh);
 		inode->i_size = 0;
 		inode->i_blocks = 0;
-
-		brelse(bh_index);
+		mark_inode_dirty(inode);
 	}
-	
+
+	/* Open files can't be evicted */
+	ouichefs_victim_open(inode);
+
+	return 0;
+}
+
+/*
+ * Called when the last reference to file is dropped. Blocks reserved for the
+ * file are given back, it will get a new window if it grows again.
+ */
+int ouichefs_release(struct inode *inode, struct file *file)
+{
+	ouichefs_discard_prealloc(inode);
+	ouichefs_victim_release(inode);
+
 	return 0;
 }
 
+/*
+ * Called by the VFS when a write() syscall occurs on a file. Buffered writes
+ * go through write_begin/write_end, direct writes bypass them so the inode
+ * metadata is updated here instead.
+ */
+static ssize_t ouichefs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	ret = generic_file_write_iter(iocb, from);
+	if (ret > 0 && (iocb->ki_flags & IOCB_DIRECT)) {
+		inode_lock(inode);
+		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
+		mark_inode_dirty(inode);
+		inode_unlock(inode);
+
+		ouichefs_trigger_eviction(inode->i_sb);
+	}
+
+	return ret;
+}
+
 const struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
 	.open = ouichefs_open,
+	.release = ouichefs_release,
 	.llseek = generic_file_llseek,
 	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter
+	.write_iter = ouichefs_write_iter,
+	.fsync = generic_file_fsync
 };
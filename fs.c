@@ -20,6 +20,7 @@
 #include "procfs_ops/evictions.h"
 #include "procfs_ops/partitions.h"
 #include "procfs_ops/clean.h"
+#include "procfs_ops/fragmentation.h"
 
 // MARK: - procfs
 
@@ -54,6 +55,9 @@ void ouichefs_kill_sb(struct super_block *sb)
 {
 	forget_partition(sb);
 
+	/* Eviction holds inodes, let it finish before they are evicted */
+	ouichefs_stop_eviction(sb);
+
 	kill_block_super(sb);
 
 	pr_info("unmounted disk\n");
@@ -108,6 +112,11 @@ static int __init ouichefs_init(void)
 		goto err_procfs;
 	}
 
+	if (!proc_create("fragmentation", 0, dir, &fragmentation_proc_ops)) {
+		pr_err("Failed to create fragmentation procfs entry\n");
+		goto err_procfs;
+	}
+
 	pr_info("module loaded\n");
 	pr_info("trigger_threshold: %d\n", trigger_threshold);
 	return 0;
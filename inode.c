@@ -11,6 +11,7 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/pagemap.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
@@ -18,6 +19,22 @@
 
 static const struct inode_operations ouichefs_inode_ops;
 
+/*
+ * Set the operations of a regular file, depending on the data path selected
+ * at mount time.
+ */
+static void ouichefs_set_file_ops(struct inode *inode)
+{
+	if (OUICHEFS_USE_IOMAP(inode->i_sb)) {
+		inode->i_fop = &ouichefs_iomap_file_ops;
+		inode->i_mapping->a_ops = &ouichefs_iomap_aops;
+		mapping_set_large_folios(inode->i_mapping);
+	} else {
+		inode->i_fop = &ouichefs_file_ops;
+		inode->i_mapping->a_ops = &ouichefs_aops;
+	}
+}
+
 /*
  * Get inode ino from disk.
  */
@@ -78,8 +95,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(inode->i_mode)) {
-		inode->i_fop = &ouichefs_file_ops;
-		inode->i_mapping->a_ops = &ouichefs_aops;
+		ouichefs_set_file_ops(inode);
 	}
 
 	brelse(bh);
@@ -129,35 +145,21 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 				      unsigned int flags)
 {
 	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_index *idx;
+	struct ouichefs_dir_entry *e;
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
 
 	/* Check filename length */
-	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
+	if (dentry->d_name.len >= OUICHEFS_NAME_LEN(sb))
 		return ERR_PTR(-ENAMETOOLONG);
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return ERR_PTR(-EIO);
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!strncmp(f->filename, dentry->d_name.name,
-			     OUICHEFS_FILENAME_LEN)) {
-			inode = ouichefs_iget(sb, f->inode);
-			break;
-		}
-	}
-	brelse(bh);
+	/* Search for the file in the index of the directory */
+	idx = ouichefs_dir_index_get(dir);
+	if (IS_ERR(idx))
+		return ERR_CAST(idx);
+	e = ouichefs_dir_find(idx, dentry->d_name.name, dentry->d_name.len);
+	if (e)
+		inode = ouichefs_iget(sb, e->ino);
 
 	/* Update directory access time */
 	dir->i_atime = current_time(dir);
@@ -193,7 +195,8 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (percpu_counter_compare(&sbi->free_inodes, 1) < 0 ||
+	    !has_free_blocks(sbi, 1))
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
@@ -207,8 +210,17 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 	ci = OUICHEFS_INODE(inode);
 
-	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
+	/*
+	 * Get a free block for this new inode's index. Files go in the
+	 * allocation group of their directory, directories are spread over the
+	 * groups.
+	 */
+	if (S_ISDIR(mode))
+		bno = get_free_block(sbi);
+	else
+		bno = get_free_block_from(
+			sbi, block_group(sbi, OUICHEFS_INODE(dir)->index_block),
+			0);
 	if (!bno) {
 		ret = -ENOSPC;
 		goto put_inode;
@@ -224,8 +236,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		set_nlink(inode, 2); /* . and .. */
 	} else if (S_ISREG(mode)) {
 		inode->i_size = 0;
-		inode->i_fop = &ouichefs_file_ops;
-		inode->i_mapping->a_ops = &ouichefs_aops;
+		ouichefs_set_file_ops(inode);
 		set_nlink(inode, 1);
 	}
 
@@ -254,40 +265,48 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	struct super_block *sb;
 	struct inode *inode;
 	struct ouichefs_inode_info *ci_dir;
+	struct ouichefs_dir_index *idx;
 	struct ouichefs_dir_block *dblock;
 	char *fblock;
 	struct buffer_head *bh, *bh2;
-	int ret = 0, i;
+	int ret = 0;
 
 	/* Check filename length */
-	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (strlen(dentry->d_name.name) >= OUICHEFS_NAME_LEN(dir->i_sb))
 		return -ENAMETOOLONG;
 
-	/* Read parent directory index */
 	ci_dir = OUICHEFS_INODE(dir);
 	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		// if parent directory is full, we try to make some space using
-		// the current eviction policy
-		// if that fails, we return the same error as previous
-		if (current_policy->clean_dir(sb, dir, dblock->files)) {
-			ret = -EMLINK;
-			goto end;
+
+	/*
+	 * Check if parent directory is full. Hashed directories have no such
+	 * limit, only their buckets do.
+	 */
+	if (!OUICHEFS_HAS_FEATURE(sb, HASHED_DIRS)) {
+		idx = ouichefs_dir_index_get(dir);
+		if (IS_ERR(idx))
+			return PTR_ERR(idx);
+		if (idx->nr_files == OUICHEFS_MAX_SUBFILES) {
+			bh = sb_bread(sb, ci_dir->index_block);
+			if (!bh)
+				return -EIO;
+			dblock = (struct ouichefs_dir_block *)bh->b_data;
+
+			// if parent directory is full, we try to make some
+			// space using the current eviction policy
+			// if that fails, we return the same error as previous
+			if (current_policy->clean_dir(sb, dir, dblock->files))
+				ret = -EMLINK;
+			brelse(bh);
+			if (ret)
+				return ret;
 		}
 	}
 
 	/* Get a new free inode */
 	inode = ouichefs_new_inode(dir, mode);
-	if (IS_ERR(inode)) {
-		ret = PTR_ERR(inode);
-		goto end;
-	}
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
 
 	/*
 	 * Scrub index_block for new file/directory to avoid previous data
@@ -303,15 +322,10 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	mark_buffer_dirty(bh2);
 	brelse(bh2);
 
-	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
-		if (dblock->files[i].inode == 0)
-			break;
-	dblock->files[i].inode = inode->i_ino;
-	strscpy(dblock->files[i].filename, dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	/* Register new inode in parent index */
+	ret = ouichefs_dir_add(dir, inode, dentry->d_name.name);
+	if (ret)
+		goto iput;
 
 	/* Update stats and mark dir and new inode dirty */
 	mark_inode_dirty(inode);
@@ -320,6 +334,9 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 		inode_inc_link_count(dir);
 	mark_inode_dirty(dir);
 
+	/* Make the new file a candidate for eviction */
+	ouichefs_victim_add(dir, inode);
+
 	/* setup dentry */
 	d_instantiate(dentry, inode);
 
@@ -332,8 +349,6 @@ iput:
 	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
 	iput(inode);
-end:
-	brelse(bh);
 	return ret;
 }
 
@@ -356,36 +371,20 @@ int ouichefs_remove(struct inode *dir, struct inode *inode)
 	struct super_block *sb = dir->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL, *bh2 = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
 	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
+	int i, ret;
 
 	ino = inode->i_ino;
 	bno = OUICHEFS_INODE(inode)->index_block;
 
-	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
 	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	ret = ouichefs_dir_del(dir, ino);
+	if (ret)
+		return ret;
+
+	/* The file can't be evicted anymore */
+	ouichefs_victim_forget(inode);
 
 	/* Update inode stats */
 	dir->i_mtime = dir->i_atime = dir->i_ctime = current_time(dir);
@@ -399,6 +398,12 @@ int ouichefs_remove(struct inode *dir, struct inode *inode)
 	 * forever. If we fail to scrub a data block, don't fail (too late
 	 * anyway), just put the block and continue.
 	 */
+	ouichefs_discard_prealloc(inode);
+	/* Delayed writes of the file are dropped before they get a block */
+	truncate_pagecache(inode, 0);
+	ouichefs_drop_delayed(inode, 0);
+	ouichefs_drop_index(inode);
+	ouichefs_dir_index_drop(inode);
 	bh = sb_bread(sb, bno);
 	if (!bh)
 		goto clean_inode;
@@ -453,65 +458,36 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 			   struct dentry *old_dentry, struct inode *new_dir,
 			   struct dentry *new_dentry, unsigned int flags)
 {
-	struct super_block *sb = old_dir->i_sb;
-	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
-	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
 	struct inode *src = d_inode(old_dentry);
-	struct buffer_head *bh_old = NULL, *bh_new = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+	struct ouichefs_dir_index *idx_new;
+	int ret;
 
 	/* fail with these unsupported flags */
 	if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
 		return -EINVAL;
 
 	/* Check if filename is not too long */
-	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (strlen(new_dentry->d_name.name) >=
+	    OUICHEFS_NAME_LEN(new_dir->i_sb))
 		return -ENAMETOOLONG;
 
-	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* if old_dir == new_dir, save the renamed file position */
-		if (new_dir == old_dir) {
-			if (strncmp(dir_block->files[i].filename,
-				    old_dentry->d_name.name,
-				    OUICHEFS_FILENAME_LEN) == 0)
-				f_pos = i;
-		}
-		if (strncmp(dir_block->files[i].filename,
-			    new_dentry->d_name.name,
-			    OUICHEFS_FILENAME_LEN) == 0) {
-			ret = -EEXIST;
-			goto release_new;
-		}
-		if (new_pos < 0 && dir_block->files[i].inode == 0)
-			new_pos = i;
-	}
-	/* if old_dir == new_dir, just rename entry */
-	if (old_dir == new_dir) {
-		strscpy(dir_block->files[f_pos].filename,
-			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto release_new;
-	}
+	/* Fail if new_dentry exists */
+	idx_new = ouichefs_dir_index_get(new_dir);
+	if (IS_ERR(idx_new))
+		return PTR_ERR(idx_new);
+	if (ouichefs_dir_find(idx_new, new_dentry->d_name.name,
+			      new_dentry->d_name.len))
+		return -EEXIST;
 
-	/* If new directory is empty, fail */
-	if (new_pos < 0) {
-		ret = -EMLINK;
-		goto release_new;
-	}
+	/* if old_dir == new_dir, just rename entry */
+	if (old_dir == new_dir)
+		return ouichefs_dir_rename(new_dir, src,
+					   new_dentry->d_name.name);
 
-	/* insert in new parent directory */
-	dir_block->files[new_pos].inode = src->i_ino;
-	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
-	brelse(bh_new);
+	/* insert in new parent directory, fails if it is full */
+	ret = ouichefs_dir_add(new_dir, src, new_dentry->d_name.name);
+	if (ret)
+		return ret;
 
 	/* Update new parent inode metadata */
 	new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
@@ -521,26 +497,9 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 	mark_inode_dirty(new_dir);
 
 	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (dir_block->files[i].inode == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
-	brelse(bh_old);
+	ret = ouichefs_dir_del(old_dir, src->i_ino);
+	if (ret)
+		return ret;
 
 	/* Update old parent inode metadata */
 	old_dir->i_atime = old_dir->i_ctime = old_dir->i_mtime =
@@ -549,11 +508,9 @@ static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 		inode_dec_link_count(old_dir);
 	mark_inode_dirty(old_dir);
 
-	return 0;
+	ouichefs_victim_move(src, new_dir);
 
-release_new:
-	brelse(bh_new);
-	return ret;
+	return 0;
 }
 
 static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
@@ -564,24 +521,18 @@ static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh;
-	struct ouichefs_dir_block *dblock;
+	struct ouichefs_dir_index *idx;
 
 	/* If the directory is not empty, fail */
 	// QUESTION: you can't remove a directory if it's not empty? why not recursive
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
+	idx = ouichefs_dir_index_get(inode);
+	if (IS_ERR(idx))
+		return PTR_ERR(idx);
+	if (idx->nr_files)
 		return -ENOTEMPTY;
-	}
-	brelse(bh);
 
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
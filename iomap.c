@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * iomap based data path for regular files, used when the partition is
+ * mounted with the "iomap" option.
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/iomap.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+
+#include "ouichefs.h"
+#include "eviction_policy/eviction_policy.h"
+
+/*
+ * Map the file range starting at pos into iomap. The whole run of contiguous
+ * blocks (or hole) found in the index block is reported at once. For writes,
+ * holes are filled with newly allocated blocks.
+ */
+static int ouichefs_iomap_begin(struct inode *inode, loff_t pos,
+				loff_t length, unsigned int flags,
+				struct iomap *iomap, struct iomap *srcmap)
+{
+	sector_t iblock = pos >> inode->i_blkbits;
+	loff_t end = min_t(loff_t, pos + length, OUICHEFS_MAX_FILESIZE);
+	uint32_t bno;
+	bool new;
+	int ret;
+
+	if (pos >= OUICHEFS_MAX_FILESIZE)
+		return -EFBIG;
+
+	ret = ouichefs_map_blocks(inode, iblock,
+				  ((end - 1) >> inode->i_blkbits) - iblock + 1,
+				  flags & IOMAP_WRITE, &bno, &new);
+	if (ret < 0)
+		return ret;
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)iblock << inode->i_blkbits;
+	iomap->length = (u64)ret << inode->i_blkbits;
+	iomap->flags = new ? IOMAP_F_NEW : 0;
+	if (bno) {
+		iomap->type = IOMAP_MAPPED;
+		iomap->addr = (u64)bno << inode->i_blkbits;
+	} else {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	}
+
+	return 0;
+}
+
+static const struct iomap_ops ouichefs_iomap_ops = {
+	.iomap_begin = ouichefs_iomap_begin,
+};
+
+/*
+ * Called by iomap writeback for each dirty block. The mapping of the previous
+ * call is reused as long as offset falls inside of it.
+ */
+static int ouichefs_map_writeback(struct iomap_writepage_ctx *wpc,
+				  struct inode *inode, loff_t offset)
+{
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
+
+	return ouichefs_iomap_begin(inode, offset,
+				    OUICHEFS_MAX_FILESIZE - offset, 0,
+				    &wpc->iomap, NULL);
+}
+
+static const struct iomap_writeback_ops ouichefs_writeback_ops = {
+	.map_blocks = ouichefs_map_writeback,
+};
+
+static int ouichefs_iomap_read_folio(struct file *file, struct folio *folio)
+{
+	return iomap_read_folio(folio, &ouichefs_iomap_ops);
+}
+
+static void ouichefs_iomap_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &ouichefs_iomap_ops);
+}
+
+static int ouichefs_iomap_writepages(struct address_space *mapping,
+				     struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = {};
+
+	return iomap_writepages(mapping, wbc, &wpc, &ouichefs_writeback_ops);
+}
+
+/*
+ * Called when a direct write completes. Writes extending the file are always
+ * waited for (IOMAP_DIO_FORCE_WAIT), so the inode lock is still held here.
+ */
+static int ouichefs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+				     int error, unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+
+	if (error)
+		return error;
+
+	if (size && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_dio_ops ouichefs_dio_write_ops = {
+	.end_io = ouichefs_dio_write_end_io,
+};
+
+const struct address_space_operations ouichefs_iomap_aops = {
+	.read_folio = ouichefs_iomap_read_folio,
+	.readahead = ouichefs_iomap_readahead,
+	.writepages = ouichefs_iomap_writepages,
+	.dirty_folio = iomap_dirty_folio,
+	.release_folio = iomap_release_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.migrate_folio = filemap_migrate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+	.direct_IO = noop_direct_IO,
+};
+
+/*
+ * Called by the VFS when a read() syscall occurs on a file. Reads on files
+ * opened with O_DIRECT go straight to the disk, extent by extent.
+ */
+static ssize_t ouichefs_iomap_read_iter(struct kiocb *iocb,
+					struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+	ret = iomap_dio_rw(iocb, to, &ouichefs_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+
+	file_accessed(iocb->ki_filp);
+
+	return ret;
+}
+
+/*
+ * Write directly to the disk for files opened with O_DIRECT. Blocks are
+ * allocated by ouichefs_iomap_begin(), and cached pages of the range are
+ * written back and invalidated by iomap beforehand.
+ * Return -ENOTBLK if the caller should fall back to a buffered write.
+ */
+static ssize_t ouichefs_iomap_direct_write(struct kiocb *iocb,
+					   struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int dio_flags = 0;
+
+	/* The new size is set at completion, we can't let it race */
+	if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+		dio_flags |= IOMAP_DIO_FORCE_WAIT;
+
+	return iomap_dio_rw(iocb, from, &ouichefs_iomap_ops,
+			    &ouichefs_dio_write_ops, dio_flags, NULL, 0);
+}
+
+/*
+ * Called by the VFS when a write() syscall occurs on a file. Data is copied to
+ * the page cache (or written directly for O_DIRECT) extent by extent, blocks
+ * are allocated on the fly by ouichefs_iomap_begin().
+ */
+static ssize_t ouichefs_iomap_write_iter(struct kiocb *iocb,
+					 struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end;
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret)
+		goto unlock;
+	ret = file_update_time(iocb->ki_filp);
+	if (ret)
+		goto unlock;
+
+	/* Check if the write can be completed, evicting files if needed */
+	end = iocb->ki_pos + iov_iter_count(from);
+	if (end > i_size_read(inode)) {
+		ret = ouichefs_wait_for_space(
+			inode->i_sb,
+			DIV_ROUND_UP(end, OUICHEFS_BLOCK_SIZE) -
+				DIV_ROUND_UP(i_size_read(inode),
+					     OUICHEFS_BLOCK_SIZE));
+		if (ret)
+			goto unlock;
+	}
+
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = ouichefs_iomap_direct_write(iocb, from);
+		/* Page cache could not be invalidated, write through it */
+		if (ret != -ENOTBLK)
+			goto unlock;
+	}
+
+	ret = iomap_file_buffered_write(iocb, from, &ouichefs_iomap_ops);
+	if (ret > 0) {
+		/* Update inode metadata */
+		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
+		mark_inode_dirty(inode);
+	}
+unlock:
+	inode_unlock(inode);
+
+	if (ret > 0) {
+		ouichefs_trigger_eviction(inode->i_sb);
+		ret = generic_write_sync(iocb, ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Called when a shared mapping of the file is about to be written to.
+ */
+static vm_fault_t ouichefs_iomap_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	filemap_invalidate_lock_shared(inode->i_mapping);
+	ret = iomap_page_mkwrite(vmf, &ouichefs_iomap_ops);
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+static const struct vm_operations_struct ouichefs_iomap_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_iomap_page_mkwrite,
+};
+
+static int ouichefs_iomap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_iomap_vm_ops;
+
+	return 0;
+}
+
+const struct file_operations ouichefs_iomap_file_ops = {
+	.owner = THIS_MODULE,
+	.open = ouichefs_open,
+	.release = ouichefs_release,
+	.llseek = generic_file_llseek,
+	.read_iter = ouichefs_iomap_read_iter,
+	.write_iter = ouichefs_iomap_write_iter,
+	.mmap = ouichefs_iomap_mmap,
+	.fsync = generic_file_fsync,
+};
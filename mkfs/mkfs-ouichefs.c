@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
+#include <getopt.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
@@ -19,6 +20,12 @@
 #define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
+#define OUICHEFS_DEFAULT_BLOCKS_PER_GROUP (OUICHEFS_BLOCK_SIZE * 8)
+
+#define OUICHEFS_FEATURE_HASHED_DIRS 0x1 /* Directories of hash buckets */
+#define OUICHEFS_FEATURE_FILETYPE 0x2 /* File type in directory entries */
+
+#define OUICHEFS_STATE_CLEAN 0x1 /* Group free counts can be trusted */
 
 struct ouichefs_inode {
 	mode_t i_mode; /* File mode */
@@ -52,7 +59,13 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t blocks_per_group; /* Allocation group size */
+	uint32_t nr_gfree_blocks; /* Number of group free count blocks */
+
+	uint32_t features; /* Format features */
+	uint32_t state; /* Clean unmount flag */
+
+	char padding[4048]; /* Padding to match block size */
 };
 
 struct ouichefs_file_index_block {
@@ -70,8 +83,12 @@ static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
-		appname);
+		"%s [-g blocks_per_group] [-H] [-t] disk\n"
+		"\t-g: size of the allocation groups, a multiple of 64 (default %d)\n"
+		"\t-H: hashed directories, not limited to %d files\n"
+		"\t-t: store the file type in directory entries\n",
+		appname, OUICHEFS_DEFAULT_BLOCKS_PER_GROUP,
+		OUICHEFS_MAX_SUBFILES);
 }
 
 /* Returns ceil(a/b) */
@@ -84,13 +101,15 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats,
+						    uint32_t blocks_per_group,
+						    uint32_t features)
 {
 	int ret;
 	struct ouichefs_superblock *sb;
 	uint32_t nr_inodes = 0, nr_blocks = 0, nr_ifree_blocks = 0;
 	uint32_t nr_bfree_blocks = 0, nr_data_blocks = 0, nr_istore_blocks = 0;
-	uint32_t mod;
+	uint32_t nr_gfree_blocks = 0, mod;
 
 	sb = malloc(sizeof(struct ouichefs_superblock));
 	if (!sb)
@@ -104,8 +123,10 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
 	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
 	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
+	nr_gfree_blocks = idiv_ceil(idiv_ceil(nr_blocks, blocks_per_group),
+				    OUICHEFS_BLOCK_SIZE / sizeof(uint32_t));
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
-			 nr_bfree_blocks;
+			 nr_bfree_blocks - nr_gfree_blocks;
 
 	memset(sb, 0, sizeof(struct ouichefs_superblock));
 	sb->magic = htole32(OUICHEFS_MAGIC);
@@ -116,6 +137,10 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->blocks_per_group = htole32(blocks_per_group);
+	sb->nr_gfree_blocks = htole32(nr_gfree_blocks);
+	sb->features = htole32(features);
+	sb->state = htole32(OUICHEFS_STATE_CLEAN);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -130,10 +155,16 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tblocks_per_group=%u\n"
+	       "\tnr_gfree_blocks=%u\n"
+	       "\tfeatures=%#x\n"
+	       "\tstate=%#x\n",
 	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->blocks_per_group, sb->nr_gfree_blocks, sb->features,
+	       sb->state);
 
 	return sb;
 }
@@ -155,6 +186,7 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	/* Root inode (inode 1) */
 	inode = (struct ouichefs_inode *)block + 1;
 	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
+			   le32toh(sb->nr_gfree_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
 			   le32toh(sb->nr_istore_blocks);
 	inode->i_mode = htole32(S_IFDIR | 0644 | 0131);
@@ -243,7 +275,8 @@ static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 	uint64_t *bfree, mask, line;
 	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
-			   le32toh(sb->nr_bfree_blocks) + 2;
+			   le32toh(sb->nr_bfree_blocks) +
+			   le32toh(sb->nr_gfree_blocks) + 2;
 
 	block = malloc(OUICHEFS_BLOCK_SIZE);
 	if (!block)
@@ -251,7 +284,7 @@ static int write_bfree_blocks(int fd, struct ouichefs_superblock *sb)
 	bfree = (uint64_t *)block;
 
 	/*
-	 * First blocks (incl. sb + istore + ifree + bfree + 1 used block)
+	 * First blocks (incl. sb + istore + ifree + bfree + gfree + 1 used block)
 	 * we suppose it won't go further than the first block
 	 */
 	memset(bfree, 0xff, OUICHEFS_BLOCK_SIZE);
@@ -291,11 +324,63 @@ end:
 	return ret;
 }
 
+/*
+ * Write the free count of each allocation group: all of its blocks, but the
+ * ones used by the metadata and the root index block at the start of the
+ * partition.
+ */
+static int write_gfree_blocks(int fd, struct ouichefs_superblock *sb)
+{
+	int ret = 0;
+	uint32_t i, g, first, end;
+	uint32_t *gfree;
+	uint32_t nr_blocks = le32toh(sb->nr_blocks);
+	uint32_t blocks_per_group = le32toh(sb->blocks_per_group);
+	uint32_t nr_groups = idiv_ceil(nr_blocks, blocks_per_group);
+	uint32_t per_block = OUICHEFS_BLOCK_SIZE / sizeof(uint32_t);
+	uint32_t nr_used = le32toh(sb->nr_istore_blocks) +
+			   le32toh(sb->nr_ifree_blocks) +
+			   le32toh(sb->nr_bfree_blocks) +
+			   le32toh(sb->nr_gfree_blocks) + 2;
+
+	gfree = malloc(OUICHEFS_BLOCK_SIZE);
+	if (!gfree)
+		return -1;
+
+	for (i = 0; i < le32toh(sb->nr_gfree_blocks); i++) {
+		memset(gfree, 0, OUICHEFS_BLOCK_SIZE);
+		for (g = i * per_block; g < nr_groups && g < (i + 1) * per_block;
+		     g++) {
+			first = g * blocks_per_group;
+			end = first + blocks_per_group;
+			if (end > nr_blocks)
+				end = nr_blocks;
+			if (first < nr_used)
+				first = nr_used;
+			if (first < end)
+				gfree[g % per_block] = htole32(end - first);
+		}
+		ret = write(fd, gfree, OUICHEFS_BLOCK_SIZE);
+		if (ret != OUICHEFS_BLOCK_SIZE) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Gfree blocks: wrote %d blocks\n", i);
+end:
+	free(gfree);
+
+	return ret;
+}
+
 static int write_root_index_block(int fd, struct ouichefs_superblock *sb)
 {
 	int ret = 0;
 	char *block;
 
+	/* Empty directory, or empty bucket list of a hashed directory */
 	block = malloc(OUICHEFS_BLOCK_SIZE);
 	if (!block)
 		return -1;
@@ -322,7 +407,8 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 	/* struct ouichefs_file_index_block foo_block; */
 	/* char *foo; */
 	/* uint32_t first_block = le32toh(sb->nr_istore_blocks) + */
-	/*	le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + 3; */
+	/*	le32toh(sb->nr_ifree_blocks) + le32toh(sb->nr_bfree_blocks) + */
+	/*	le32toh(sb->nr_gfree_blocks) + 3; */
 
 	/* foo = malloc(OUICHEFS_BLOCK_SIZE); */
 	/* if (!foo) */
@@ -337,18 +423,46 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 
 int main(int argc, char **argv)
 {
-	int ret = EXIT_SUCCESS, fd;
+	int ret = EXIT_SUCCESS, fd, opt;
 	long min_size;
 	struct stat stat_buf;
 	struct ouichefs_superblock *sb = NULL;
+	unsigned long blocks_per_group = OUICHEFS_DEFAULT_BLOCKS_PER_GROUP;
+	uint32_t features = 0;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "g:Ht")) != -1) {
+		switch (opt) {
+		case 'g':
+			blocks_per_group = strtoul(optarg, &end, 0);
+			if (*end || !blocks_per_group ||
+			    blocks_per_group % 64 ||
+			    blocks_per_group > UINT32_MAX) {
+				fprintf(stderr,
+					"Invalid group size: %s (must be a multiple of 64)\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			features |= OUICHEFS_FEATURE_HASHED_DIRS;
+			break;
+		case 't':
+			features |= OUICHEFS_FEATURE_FILETYPE;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
 
-	if (argc != 2 || argv[1][0] == '-') {
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -373,7 +487,7 @@ int main(int argc, char **argv)
 	}
 
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(fd, &stat_buf, blocks_per_group, features);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
@@ -404,6 +518,14 @@ int main(int argc, char **argv)
 		goto free_sb;
 	}
 
+	/* Write group free count blocks */
+	ret = write_gfree_blocks(fd, sb);
+	if (ret != 0) {
+		perror("write_gfree_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
 	/* Write the root index block */
 	ret = write_root_index_block(fd, sb);
 	if (ret != 0) {
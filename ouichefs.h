@@ -8,6 +8,12 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
@@ -30,6 +36,9 @@
  * +---------------+
  * | bfree bitmap  |  sb->nr_bfree_blocks blocks
  * +---------------+
+ * | group free    |  sb->nr_gfree_blocks blocks
+ * |   counts      |
+ * +---------------+
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
@@ -52,15 +61,60 @@ struct ouichefs_inode {
 	uint32_t index_block; /* Block with list of blocks for this file */
 };
 
+/*
+ * Bounds of the preallocation window of a growing file, in blocks, see
+ * file.c
+ */
+#define OUICHEFS_PREALLOC_MIN 4
+#define OUICHEFS_PREALLOC_MAX 64
+
+struct ouichefs_dir_index;
+
 struct ouichefs_inode_info {
 	uint32_t index_block;
+	struct buffer_head *index_bh; /* Pinned index block (regular files) */
+	struct mutex alloc_lock; /* Serializes filling the holes of the index */
+
+	spinlock_t prealloc_lock; /* Protects the preallocation window */
+	uint32_t prealloc_start; /* First reserved block */
+	uint32_t prealloc_len; /* Number of reserved blocks left */
+	uint32_t prealloc_size; /* Size of the next window */
+	struct list_head prealloc_list; /* In sbi->prealloc_list */
+
+	/* Blocks of the file reserved by delayed writes, not allocated yet */
+	DECLARE_BITMAP(delayed, OUICHEFS_BLOCK_SIZE >> 2);
+
+	struct ouichefs_dir_index *dir_index; /* Directories only, or NULL */
+
 	struct inode vfs_inode;
 };
 
 #define OUICHEFS_INODES_PER_BLOCK \
 	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
 
-struct ouichefs_sb_info {
+struct ouichefs_victim_index;
+
+#define OUICHEFS_EXTENT_HIST 16
+
+/* Free extents of a partition, see extent.c */
+struct ouichefs_extent_tree {
+	struct rb_root by_start; /* Ordered by first block */
+	struct rb_root by_len; /* Ordered by length */
+	uint32_t nr_extents;
+	uint32_t hist[OUICHEFS_EXTENT_HIST]; /* Extents by power of 2 of len */
+	uint32_t gen; /* Bumped on every change of the bitmap */
+	bool stale; /* Out of sync after a failed allocation, rebuild it */
+};
+
+struct ouichefs_extent_stats {
+	uint32_t nr_extents; /* Number of free extents */
+	uint32_t largest; /* Length of the largest free extent */
+	uint32_t hist[OUICHEFS_EXTENT_HIST]; /* By power of 2 of the length */
+	uint32_t nr_loaded; /* Groups with their bitmap in memory */
+};
+
+/* On-disk superblock */
+struct ouichefs_superblock {
 	uint32_t magic; /* Magic number */
 
 	uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
@@ -73,23 +127,160 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+	uint32_t blocks_per_group; /* Allocation group size, 0 for default */
+	uint32_t nr_gfree_blocks; /* Number of group free count blocks */
+
+	uint32_t features; /* Format features (OUICHEFS_FEATURE_*) */
+	uint32_t state; /* OUICHEFS_STATE_* */
 };
 
+/*
+ * Set on a clean unmount, cleared while mounted: the group free counts table
+ * can only be trusted if it is set.
+ */
+#define OUICHEFS_STATE_CLEAN 0x1
+
+/* Format features, set by mkfs */
+#define OUICHEFS_FEATURE_HASHED_DIRS 0x1 /* Directories of hash buckets */
+#define OUICHEFS_FEATURE_FILETYPE 0x2 /* File type in directory entries */
+#define OUICHEFS_FEATURES \
+	(OUICHEFS_FEATURE_HASHED_DIRS | OUICHEFS_FEATURE_FILETYPE)
+
+/*
+ * The blocks of a partition are split in allocation groups, each with its own
+ * lock, so that concurrent allocations don't contend. Groups are a multiple of
+ * 64 blocks so that a word of the free blocks bitmap never spans two groups.
+ */
+#define OUICHEFS_DEFAULT_BLOCKS_PER_GROUP (OUICHEFS_BLOCK_SIZE * 8)
+
+/*
+ * The free count of each group is kept on disk after the block free bitmap,
+ * so that the bitmap of a group is only read when the group is first used.
+ * Partitions without this table (nr_gfree_blocks is 0) load all of it at
+ * mount.
+ */
+#define OUICHEFS_GFREE_PER_BLOCK (OUICHEFS_BLOCK_SIZE / sizeof(uint32_t))
+
+struct ouichefs_group {
+	spinlock_t lock; /* Protects the bitmap of the group */
+	uint32_t nr_free; /* Number of free blocks in the group */
+	uint32_t cursor; /* Where allocations without goal start */
+	unsigned long *bitmap; /* Free bits from the first block, or NULL */
+	unsigned long *summary; /* Words of bitmap with a free bit */
+	void *vmap; /* Mapping of bitmap when it spans several blocks */
+	struct ouichefs_extent_tree free_extents; /* Free extents index */
+} ____cacheline_aligned_in_smp;
+
+/* In-memory superblock */
+struct ouichefs_sb_info {
+	uint32_t magic; /* Magic number */
+
+	uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
+	uint32_t nr_inodes; /* Total number of inodes */
+
+	uint32_t nr_istore_blocks; /* Number of inode store blocks */
+	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
+	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+
+	struct percpu_counter free_inodes; /* Number of free inodes */
+	struct percpu_counter free_blocks; /* Number of free blocks */
+	struct percpu_counter reserved_blocks; /* Blocks of delayed writes */
+
+	spinlock_t bitmap_lock; /* Protects ifree_bitmap, see bitmap.h */
+	unsigned long *ifree_bitmap; /* Free inodes bitmap, mapped ifree_bhs */
+	struct buffer_head **ifree_bhs; /* Pinned blocks of ifree_bitmap */
+	struct buffer_head **bfree_bhs; /* Loaded blocks of the block bitmap */
+	unsigned long *ifree_summary; /* Words of ifree_bitmap with a free bit */
+	unsigned long *ifree_dirty; /* Blocks of ifree_bitmap to write back */
+	unsigned long *bfree_dirty; /* Blocks of bfree_bhs to write back */
+
+	uint32_t blocks_per_group; /* Size of the allocation groups */
+	uint32_t nr_groups; /* Number of allocation groups */
+	struct ouichefs_group *groups; /* Allocation groups */
+	struct mutex load_lock; /* Serializes the loading of groups */
+	uint32_t nr_gfree_blocks; /* Number of group free count blocks */
+	struct buffer_head **gfree_bhs; /* Pinned group free count blocks */
+
+	uint32_t features; /* Format features (OUICHEFS_FEATURE_*) */
+
+	spinlock_t prealloc_lock; /* Protects prealloc_list */
+	struct list_head prealloc_list; /* Inodes with a preallocation window */
+
+	unsigned long mount_opts; /* Mount options (OUICHEFS_MOUNT_*) */
+
+	struct super_block *sb; /* Back pointer to the VFS superblock */
+	struct work_struct evict_work; /* Background eviction */
+	struct ouichefs_victim_index *victims; /* Eviction order of files */
+};
+
+/* Mount options */
+#define OUICHEFS_MOUNT_IOMAP 0x1 /* Use the iomap data path */
+
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/*
+ * With the OUICHEFS_FEATURE_FILETYPE feature, the last byte of filename holds
+ * the type of the file (FT_*), and names are one byte shorter.
+ */
 struct ouichefs_file {
 	uint32_t inode;
 	char filename[OUICHEFS_FILENAME_LEN];
 };
 
+#define OUICHEFS_FILETYPE_BYTE (OUICHEFS_FILENAME_LEN - 1)
+
+/* Entries may be anywhere in the block, free slots have a null inode */
 struct ouichefs_dir_block {
 	struct ouichefs_file files[OUICHEFS_MAX_SUBFILES];
 };
 
+/*
+ * With the OUICHEFS_FEATURE_HASHED_DIRS feature, the index block of a
+ * directory lists the blocks of its buckets, allocated on first use and freed
+ * once empty. Each bucket is a struct ouichefs_dir_block, holding the entries
+ * whose name hashes to it (see dir.c). Otherwise, the index block is the only
+ * bucket of the directory.
+ */
+#define OUICHEFS_DIR_BUCKETS (OUICHEFS_BLOCK_SIZE >> 2)
+
+struct ouichefs_dir_index_block {
+	uint32_t buckets[OUICHEFS_DIR_BUCKETS];
+};
+
+/*
+ * In-memory index of the entries of a directory, by name and by inode, see
+ * dir.c. It is built on first use and protected by the directory inode lock:
+ * lookups and readdir hold it shared and only read the index.
+ */
+struct ouichefs_dir_entry {
+	struct hlist_node by_name;
+	struct hlist_node by_ino;
+	uint32_t hash; /* Hash of name */
+	uint32_t ino;
+	uint32_t bucket; /* Bucket of the entry */
+	uint32_t slot; /* Position in the bucket */
+	uint8_t type; /* FT_* type of the file, FT_UNKNOWN if not stored */
+	char name[OUICHEFS_FILENAME_LEN];
+};
+
+struct ouichefs_dir_bucket {
+	uint32_t bno; /* Block of the bucket */
+	uint32_t nr_files; /* Number of entries */
+	DECLARE_BITMAP(used, OUICHEFS_MAX_SUBFILES); /* Slots holding an entry */
+	struct ouichefs_dir_entry **slots; /* NULL while empty */
+};
+
+struct ouichefs_dir_index {
+	uint32_t nr_files; /* Number of entries */
+	unsigned int bits; /* Hash tables have 2^bits heads */
+	struct hlist_head *by_name;
+	struct hlist_head *by_ino;
+	uint32_t nr_buckets; /* 1, or OUICHEFS_DIR_BUCKETS if hashed */
+	struct xarray buckets; /* Buckets that have a block, by number */
+};
+
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
@@ -102,13 +293,66 @@ int ouichefs_remove(struct inode *dir, struct inode *inode);
 int ouichefs_unlink(struct inode *dir, struct dentry *dentry);
 
 /* file functions */
+struct ouichefs_file_index_block *ouichefs_get_index(struct inode *inode);
+void ouichefs_drop_index(struct inode *inode);
+int ouichefs_map_blocks(struct inode *inode, sector_t iblock,
+			unsigned int max_blocks, bool create, uint32_t *bno,
+			bool *new);
+int ouichefs_open(struct inode *inode, struct file *file);
+int ouichefs_release(struct inode *inode, struct file *file);
+void ouichefs_discard_prealloc(struct inode *inode);
+void ouichefs_drop_delayed(struct inode *inode, sector_t iblock);
+void ouichefs_discard_all_prealloc(struct super_block *sb);
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
 
+/* directory index functions */
+struct ouichefs_dir_index *ouichefs_dir_index_get(struct inode *dir);
+void ouichefs_dir_index_drop(struct inode *dir);
+struct ouichefs_dir_entry *ouichefs_dir_find(struct ouichefs_dir_index *idx,
+					     const char *name,
+					     unsigned int len);
+struct ouichefs_dir_entry *
+ouichefs_dir_find_ino(struct ouichefs_dir_index *idx, uint32_t ino);
+int ouichefs_dir_add(struct inode *dir, struct inode *inode,
+		     const char *name);
+int ouichefs_dir_del(struct inode *dir, uint32_t ino);
+int ouichefs_dir_rename(struct inode *dir, struct inode *inode,
+			const char *name);
+
+/* allocation groups functions */
+int ouichefs_load_group(struct ouichefs_sb_info *sbi, uint32_t g);
+
+/* free extents functions */
+int ouichefs_build_extents(struct ouichefs_sb_info *sbi, uint32_t group);
+void ouichefs_destroy_extents(struct ouichefs_sb_info *sbi);
+void ouichefs_extent_alloc(struct ouichefs_sb_info *sbi, uint32_t bno);
+void ouichefs_extent_free(struct ouichefs_sb_info *sbi, uint32_t start,
+			  uint32_t len);
+void ouichefs_extent_invalidate(struct ouichefs_sb_info *sbi, uint32_t bno);
+uint32_t ouichefs_extent_best_fit(struct ouichefs_sb_info *sbi, uint32_t nr,
+				  uint32_t *len);
+void ouichefs_extent_stats(struct ouichefs_sb_info *sbi,
+			   struct ouichefs_extent_stats *stats);
+
+/* iomap data path */
+extern const struct file_operations ouichefs_iomap_file_ops;
+extern const struct address_space_operations ouichefs_iomap_aops;
+
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
+#define OUICHEFS_HAS_FEATURE(sb, name) \
+	(((struct ouichefs_sb_info *)OUICHEFS_SB(sb))->features & \
+	 OUICHEFS_FEATURE_##name)
+/* Longest name of a directory entry, with its terminating NUL */
+#define OUICHEFS_NAME_LEN(sb) \
+	(OUICHEFS_HAS_FEATURE(sb, FILETYPE) ? OUICHEFS_FILETYPE_BYTE : \
+					      OUICHEFS_FILENAME_LEN)
+#define OUICHEFS_USE_IOMAP(sb) \
+	(((struct ouichefs_sb_info *)OUICHEFS_SB(sb))->mount_opts & \
+	 OUICHEFS_MOUNT_IOMAP)
 
 #endif /* _OUICHEFS_H */
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/kernel.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+
+#include "../ouichefs.h"
+
+// MARK: - procfs
+
+/**
+ * fragmentation_show - Display the free space fragmentation of the partitions
+ *
+ * @m: The seq_file pointer for output.
+ * @v: Unused argument.
+ *
+ * For each partition using ouiche_fs, this function prints the number of free
+ * blocks, the number of free extents, the largest free extent, and a histogram
+ * of the free extent lengths (in blocks, by power of 2). A partition whose
+ * largest extent is small compared to its free blocks is too fragmented to
+ * stream well. Extents are only known for the groups whose bitmap is loaded.
+ *
+ * Return: Always returns 0.
+ */
+static int fragmentation_show(struct seq_file *m, void *v)
+{
+	struct partition *item;
+	struct list_head *head = &first_partition.list;
+	struct ouichefs_extent_stats stats;
+	struct ouichefs_sb_info *sbi;
+	int i;
+
+	list_for_each_entry(item, head, list) {
+		sbi = OUICHEFS_SB(item->sb);
+		if (!sbi)
+			continue;
+
+		ouichefs_extent_stats(sbi, &stats);
+
+		seq_printf(m, "%s\n", item->name);
+		seq_printf(m, "free blocks:\t%lld\n",
+			   percpu_counter_sum_positive(&sbi->free_blocks));
+		seq_printf(m, "loaded groups:\t%u/%u\n", stats.nr_loaded,
+			   sbi->nr_groups);
+		seq_printf(m, "free extents:\t%u\n", stats.nr_extents);
+		seq_printf(m, "largest extent:\t%u\n", stats.largest);
+		seq_puts(m, "EXTENT SIZE\tCOUNT\n");
+		for (i = 0; i < OUICHEFS_EXTENT_HIST; i++) {
+			if (i == OUICHEFS_EXTENT_HIST - 1)
+				seq_printf(m, "%u+\t\t%u\n", 1U << i,
+					   stats.hist[i]);
+			else
+				seq_printf(m, "%u-%u\t\t%u\n", 1U << i,
+					   (2U << i) - 1, stats.hist[i]);
+		}
+	}
+
+	return 0;
+}
+
+static int fragmentation_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fragmentation_show, NULL);
+}
+
+const struct proc_ops fragmentation_proc_ops = {
+	.proc_open = fragmentation_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
@@ -9,11 +9,18 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
 
 #include "ouichefs.h"
+#include "bitmap.h"
+#include "eviction_policy/eviction_policy.h"
 
 static struct kmem_cache *ouichefs_inode_cache;
 
@@ -40,6 +47,15 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	ci = kmem_cache_alloc(ouichefs_inode_cache, GFP_KERNEL);
 	if (!ci)
 		return NULL;
+	ci->index_bh = NULL;
+	mutex_init(&ci->alloc_lock);
+	spin_lock_init(&ci->prealloc_lock);
+	ci->prealloc_start = 0;
+	ci->prealloc_len = 0;
+	ci->prealloc_size = OUICHEFS_PREALLOC_MIN;
+	INIT_LIST_HEAD(&ci->prealloc_list);
+	bitmap_zero(ci->delayed, OUICHEFS_BLOCK_SIZE >> 2);
+	ci->dir_index = NULL;
 	inode_init_once(&ci->vfs_inode);
 	return &ci->vfs_inode;
 }
@@ -52,6 +68,28 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	ouichefs_discard_prealloc(inode);
+	truncate_inode_pages_final(&inode->i_data);
+	ouichefs_drop_delayed(inode, 0);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+
+	/* Unpin the cached index block */
+	ouichefs_drop_index(inode);
+	ouichefs_dir_index_drop(inode);
+}
+
+/*
+ * Called when the inode is dirtied, keep its position in the victim index up
+ * to date.
+ */
+static void ouichefs_dirty_inode(struct inode *inode, int flags)
+{
+	ouichefs_victim_update(inode);
+}
+
 static int ouichefs_write_inode(struct inode *inode,
 				struct writeback_control *wbc)
 {
@@ -98,22 +136,24 @@ static int ouichefs_write_inode(struct inode *inode,
 static int sync_sb_info(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
+	struct ouichefs_superblock *disk_sb;
 	struct buffer_head *bh;
 
 	/* Flush superblock */
 	bh = sb_bread(sb, 0);
 	if (!bh)
 		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+	disk_sb = (struct ouichefs_superblock *)bh->b_data;
 
 	disk_sb->nr_blocks = sbi->nr_blocks;
 	disk_sb->nr_inodes = sbi->nr_inodes;
 	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
 	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->nr_free_inodes =
+		percpu_counter_sum_positive(&sbi->free_inodes);
+	disk_sb->nr_free_blocks =
+		percpu_counter_sum_positive(&sbi->free_blocks);
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -123,29 +163,53 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	return 0;
 }
 
-static int sync_ifree(struct super_block *sb, int wait)
+/*
+ * Write state to the superblock on disk, and wait for it.
+ */
+static int write_state(struct super_block *sb, uint32_t state)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_superblock *disk_sb;
 	struct buffer_head *bh;
-	int i, idx;
 
-	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
+	bh = sb_bread(sb, 0);
+	if (!bh)
+		return -EIO;
+	disk_sb = (struct ouichefs_superblock *)bh->b_data;
+	disk_sb->state = state;
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
 
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
+	return 0;
+}
 
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+/*
+ * Write back the blocks of a free bitmap that changed since the last sync.
+ * The bitmap lives in pinned buffer heads, which are only dirtied here so
+ * that the disk is updated at sync time like before. Their dirty bit is
+ * cleared first, so that a change made meanwhile is written back by the next
+ * sync.
+ */
+static void sync_bitmap(struct buffer_head **bhs, unsigned long *dirty,
+			uint32_t nr, int wait)
+{
+	uint32_t i;
 
-		mark_buffer_dirty(bh);
+	for_each_set_bit(i, dirty, nr) {
+		clear_bit(i, dirty);
+		mark_buffer_dirty(bhs[i]);
 		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
+			sync_dirty_buffer(bhs[i]);
 	}
+}
+
+static int sync_ifree(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	/* Flush free inodes bitmask */
+	sync_bitmap(sbi->ifree_bhs, sbi->ifree_dirty, sbi->nr_ifree_blocks,
+		    wait);
 
 	return 0;
 }
@@ -153,37 +217,262 @@ static int sync_ifree(struct super_block *sb, int wait)
 static int sync_bfree(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
 
-	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+	/* Flush free blocks bitmask, only loaded blocks can be dirty */
+	sync_bitmap(sbi->bfree_bhs, sbi->bfree_dirty, sbi->nr_bfree_blocks,
+		    wait);
 
-		bh = sb_bread(sb, idx);
-		if (!bh)
-			return -EIO;
-
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+	return 0;
+}
 
-		mark_buffer_dirty(bh);
+/* Write back the blocks of the group free counts table that changed */
+static int sync_gfree(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t i, g, nr_free, *counts;
+	bool changed;
+
+	for (i = 0; i < sbi->nr_gfree_blocks; i++) {
+		counts = (uint32_t *)sbi->gfree_bhs[i]->b_data;
+		changed = false;
+		for (g = i * OUICHEFS_GFREE_PER_BLOCK;
+		     g < min_t(uint32_t, sbi->nr_groups,
+			       (i + 1) * OUICHEFS_GFREE_PER_BLOCK);
+		     g++) {
+			nr_free = READ_ONCE(sbi->groups[g].nr_free);
+			if (counts[g % OUICHEFS_GFREE_PER_BLOCK] != nr_free) {
+				counts[g % OUICHEFS_GFREE_PER_BLOCK] = nr_free;
+				changed = true;
+			}
+		}
+		if (!changed)
+			continue;
+		mark_buffer_dirty(sbi->gfree_bhs[i]);
 		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
+			sync_dirty_buffer(sbi->gfree_bhs[i]);
 	}
 
 	return 0;
 }
 
+/*
+ * Start reading nr blocks from block first at once, so that the sb_bread()
+ * that follow find them in the buffer cache instead of waiting for each of
+ * them in turn. The plug lets the block layer merge them in large requests.
+ */
+static void readahead_blocks(struct super_block *sb, uint32_t first,
+			     uint32_t nr)
+{
+	struct blk_plug plug;
+	uint32_t i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++)
+		sb_breadahead(sb, first + i);
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Map the nr blocks of bhs, which are consecutive on disk, in a single virtual
+ * range. Consecutive blocks are contiguous in the page cache of the device, so
+ * their data is used in place, without a copy.
+ * Return the mapping (to be released with vunmap()), or NULL on failure.
+ */
+static void *map_blocks(struct buffer_head **bhs, uint32_t nr)
+{
+	struct page **pages, *page;
+	unsigned int nr_pages = 0;
+	void *addr;
+	uint32_t i;
+
+	pages = kvmalloc_array(nr, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		/* Blocks smaller than a page share it with their neighbours */
+		page = virt_to_page(bhs[i]->b_data);
+		if (!nr_pages || pages[nr_pages - 1] != page)
+			pages[nr_pages++] = page;
+	}
+
+	addr = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	kvfree(pages);
+
+	return addr;
+}
+
+/*
+ * Read the nr blocks of a free bitmap starting at block first, keep their
+ * buffer heads pinned in bhs, and map them to use the bitmap in place.
+ * Return the bitmap, or NULL on failure (bhs is released by unmap_bitmap()).
+ */
+static unsigned long *map_bitmap(struct super_block *sb, uint32_t first,
+				 uint32_t nr, struct buffer_head **bhs)
+{
+	void *addr;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		bhs[i] = sb_bread(sb, first + i);
+		if (!bhs[i])
+			return NULL;
+	}
+
+	addr = map_blocks(bhs, nr);
+	if (!addr)
+		return NULL;
+
+	return addr + offset_in_page(bhs[0]->b_data);
+}
+
+/* Undo map_bitmap(), bitmap may be NULL if it failed */
+static void unmap_bitmap(unsigned long *bitmap, struct buffer_head **bhs,
+			 uint32_t nr)
+{
+	uint32_t i;
+
+	if (bitmap)
+		vunmap((void *)((unsigned long)bitmap & PAGE_MASK));
+	if (!bhs)
+		return;
+	for (i = 0; i < nr; i++)
+		brelse(bhs[i]);
+	kvfree(bhs);
+}
+
+/*
+ * Load the block bitmap of group g: read the blocks holding it, which may be
+ * shared with the neighbouring groups, and keep them pinned. The free count
+ * of the group is refreshed from the bitmap, it was only known from the group
+ * free counts table until now.
+ * Return 0 on success, or a negative error code.
+ */
+int ouichefs_load_group(struct ouichefs_sb_info *sbi, uint32_t g)
+{
+	struct ouichefs_group *grp = &sbi->groups[g];
+	struct super_block *sb = sbi->sb;
+	uint32_t first = group_first_block(sbi, g);
+	uint32_t end = group_end_block(sbi, g);
+	uint32_t first_b = BITMAP_BLOCK(first), last_b = BITMAP_BLOCK(end - 1);
+	uint32_t start = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + 1;
+	unsigned long *bitmap, *summary;
+	unsigned int nofs;
+	void *addr = NULL;
+	uint32_t b, weight;
+	int ret = 0;
+
+	mutex_lock(&sbi->load_lock);
+	if (grp->bitmap)
+		goto unlock;
+
+	/* We may be called from writeback, don't recurse into the fs */
+	nofs = memalloc_nofs_save();
+
+	readahead_blocks(sb, start + first_b, last_b - first_b + 1);
+	for (b = first_b; b <= last_b; b++) {
+		if (sbi->bfree_bhs[b])
+			continue;
+		sbi->bfree_bhs[b] = sb_bread(sb, start + b);
+		if (!sbi->bfree_bhs[b]) {
+			ret = -EIO;
+			goto restore;
+		}
+	}
+
+	if (first_b == last_b) {
+		bitmap = (unsigned long *)sbi->bfree_bhs[first_b]->b_data;
+	} else {
+		addr = map_blocks(sbi->bfree_bhs + first_b,
+				  last_b - first_b + 1);
+		if (!addr) {
+			ret = -ENOMEM;
+			goto restore;
+		}
+		bitmap = addr + offset_in_page(sbi->bfree_bhs[first_b]->b_data);
+	}
+	bitmap += BIT_WORD(first % (OUICHEFS_BLOCK_SIZE * 8));
+
+	summary = alloc_summary(bitmap, end - first);
+	if (!summary) {
+		if (addr)
+			vunmap(addr);
+		ret = -ENOMEM;
+		goto restore;
+	}
+
+	spin_lock(&grp->lock);
+	grp->summary = summary;
+	grp->vmap = addr;
+	/* Not indexed yet, the extent index is built below */
+	grp->free_extents.stale = true;
+	grp->bitmap = bitmap;
+	weight = bitmap_weight(bitmap, end - first);
+	percpu_counter_add(&sbi->free_blocks, (s64)weight - grp->nr_free);
+	WRITE_ONCE(grp->nr_free, weight);
+	spin_unlock(&grp->lock);
+
+	/* On failure, the index is rebuilt on its next use */
+	ouichefs_build_extents(sbi, g);
+
+restore:
+	memalloc_nofs_restore(nofs);
+unlock:
+	mutex_unlock(&sbi->load_lock);
+
+	return ret;
+}
+
+/* Release the allocation groups and the parts of the block bitmap loaded */
+static void release_groups(struct ouichefs_sb_info *sbi)
+{
+	uint32_t i;
+
+	if (sbi->groups) {
+		for (i = 0; i < sbi->nr_groups; i++) {
+			if (sbi->groups[i].vmap)
+				vunmap(sbi->groups[i].vmap);
+			bitmap_free(sbi->groups[i].summary);
+		}
+		ouichefs_destroy_extents(sbi);
+		kfree(sbi->groups);
+	}
+	if (sbi->bfree_bhs) {
+		for (i = 0; i < sbi->nr_bfree_blocks; i++)
+			brelse(sbi->bfree_bhs[i]);
+		kvfree(sbi->bfree_bhs);
+	}
+	if (sbi->gfree_bhs) {
+		for (i = 0; i < sbi->nr_gfree_blocks; i++)
+			brelse(sbi->gfree_bhs[i]);
+		kvfree(sbi->gfree_bhs);
+	}
+}
+
+static int ouichefs_sync_fs(struct super_block *sb, int wait);
+
 static void ouichefs_put_super(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
+		ouichefs_release_eviction(sb);
+		/*
+		 * Evicted inodes may have freed blocks since the last sync.
+		 * Once synced again, the group free counts are exact.
+		 */
+		if (!sb_rdonly(sb) && sbi->nr_gfree_blocks &&
+		    !ouichefs_sync_fs(sb, 1))
+			write_state(sb, OUICHEFS_STATE_CLEAN);
+		unmap_bitmap(sbi->ifree_bitmap, sbi->ifree_bhs,
+			     sbi->nr_ifree_blocks);
+		bitmap_free(sbi->ifree_summary);
+		bitmap_free(sbi->ifree_dirty);
+		bitmap_free(sbi->bfree_dirty);
+		release_groups(sbi);
+		percpu_counter_destroy(&sbi->free_inodes);
+		percpu_counter_destroy(&sbi->free_blocks);
+		percpu_counter_destroy(&sbi->reserved_blocks);
 		kfree(sbi);
 	}
 }
@@ -192,6 +481,9 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	int ret = 0;
 
+	/* Preallocation windows live in memory only */
+	ouichefs_discard_all_prealloc(sb);
+
 	ret = sync_sb_info(sb, wait);
 	if (ret)
 		return ret;
@@ -199,6 +491,9 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 	if (ret)
 		return ret;
 	ret = sync_bfree(sb, wait);
+	if (ret)
+		return ret;
+	ret = sync_gfree(sb, wait);
 	if (ret)
 		return ret;
 
@@ -213,11 +508,25 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_type = OUICHEFS_MAGIC;
 	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	/* Blocks reserved by delayed writes are as good as used */
+	stat->f_bfree = max_t(s64, percpu_counter_sum(&sbi->free_blocks) -
+					   percpu_counter_sum(&sbi->reserved_blocks),
+			      0);
+	stat->f_bavail = stat->f_bfree;
 	stat->f_files = sbi->nr_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
-	stat->f_namelen = OUICHEFS_FILENAME_LEN;
+	stat->f_ffree = percpu_counter_sum_positive(&sbi->free_inodes);
+	/* OUICHEFS_NAME_LEN counts the terminating NUL */
+	stat->f_namelen = OUICHEFS_NAME_LEN(sb) - 1;
+
+	return 0;
+}
+
+static int ouichefs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+
+	if (sbi->mount_opts & OUICHEFS_MOUNT_IOMAP)
+		seq_puts(m, ",iomap");
 
 	return 0;
 }
@@ -226,19 +535,149 @@ static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
+	.evict_inode = ouichefs_evict_inode,
+	.dirty_inode = ouichefs_dirty_inode,
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
+	.show_options = ouichefs_show_options,
+};
+
+enum { Opt_iomap, Opt_noiomap, Opt_err };
+
+static const match_table_t tokens = {
+	{ Opt_iomap, "iomap" },
+	{ Opt_noiomap, "noiomap" },
+	{ Opt_err, NULL },
 };
 
+/*
+ * Parse the mount options:
+ *   - iomap: use the iomap data path for regular files
+ *   - noiomap: use the buffer_head data path for regular files (default)
+ */
+static int ouichefs_parse_options(struct super_block *sb, char *options)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_iomap:
+			sbi->mount_opts |= OUICHEFS_MOUNT_IOMAP;
+			break;
+		case Opt_noiomap:
+			sbi->mount_opts &= ~OUICHEFS_MOUNT_IOMAP;
+			break;
+		default:
+			pr_err("Unknown mount option '%s'\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* Load the bitmaps of all the groups, which counts their free blocks */
+static int load_all_groups(struct ouichefs_sb_info *sbi)
+{
+	uint32_t g;
+	int ret;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		ret = ouichefs_load_group(sbi, g);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the allocation groups of a partition. Their free count comes from the
+ * group free counts table, and their bitmap is loaded on first use. Without
+ * the table, or if the partition was not unmounted cleanly (state), every
+ * group is loaded now.
+ */
+static int ouichefs_init_groups(struct super_block *sb, uint32_t state)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_group *grp;
+	uint32_t g, i, *counts;
+	s64 nr_free = 0;
+
+	sbi->nr_groups = DIV_ROUND_UP(sbi->nr_blocks, sbi->blocks_per_group);
+	sbi->groups = kcalloc(sbi->nr_groups, sizeof(*sbi->groups), GFP_KERNEL);
+	if (!sbi->groups)
+		return -ENOMEM;
+	sbi->bfree_bhs = kvcalloc(sbi->nr_bfree_blocks, sizeof(*sbi->bfree_bhs),
+				  GFP_KERNEL);
+	if (!sbi->bfree_bhs)
+		return -ENOMEM;
+	mutex_init(&sbi->load_lock);
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		spin_lock_init(&grp->lock);
+		grp->cursor = group_first_block(sbi, g);
+	}
+
+	if (!sbi->nr_gfree_blocks)
+		return load_all_groups(sbi);
+
+	if (sbi->nr_gfree_blocks <
+	    DIV_ROUND_UP(sbi->nr_groups, OUICHEFS_GFREE_PER_BLOCK)) {
+		pr_err("Group free counts table too small: %u blocks\n",
+		       sbi->nr_gfree_blocks);
+		return -EINVAL;
+	}
+	sbi->gfree_bhs = kvcalloc(sbi->nr_gfree_blocks,
+				  sizeof(*sbi->gfree_bhs), GFP_KERNEL);
+	if (!sbi->gfree_bhs)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->nr_gfree_blocks; i++) {
+		sbi->gfree_bhs[i] = sb_bread(sb, sbi->nr_istore_blocks +
+						     sbi->nr_ifree_blocks +
+						     sbi->nr_bfree_blocks + 1 + i);
+		if (!sbi->gfree_bhs[i])
+			return -EIO;
+	}
+
+	/* The table is written back at the next sync */
+	if (!(state & OUICHEFS_STATE_CLEAN)) {
+		pr_info("%s was not unmounted cleanly, counting free blocks\n",
+			sb->s_id);
+		return load_all_groups(sbi);
+	}
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		i = g / OUICHEFS_GFREE_PER_BLOCK;
+		counts = (uint32_t *)sbi->gfree_bhs[i]->b_data;
+		sbi->groups[g].nr_free = counts[g % OUICHEFS_GFREE_PER_BLOCK];
+		nr_free += sbi->groups[g].nr_free;
+	}
+	percpu_counter_add(&sbi->free_blocks, nr_free);
+
+	return 0;
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh = NULL;
-	struct ouichefs_sb_info *csb = NULL;
+	struct ouichefs_superblock *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	uint32_t state;
+	int ret = 0;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
@@ -251,7 +690,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
 	if (!bh)
 		return -EIO;
-	csb = (struct ouichefs_sb_info *)bh->b_data;
+	csb = (struct ouichefs_superblock *)bh->b_data;
 
 	/* Check magic number */
 	if (csb->magic != sb->s_magic) {
@@ -271,61 +710,111 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
 	sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
-	sbi->nr_free_inodes = csb->nr_free_inodes;
-	sbi->nr_free_blocks = csb->nr_free_blocks;
+	sbi->blocks_per_group = csb->blocks_per_group;
+	sbi->nr_gfree_blocks = csb->nr_gfree_blocks;
+	sbi->features = csb->features;
+	state = csb->state;
+	spin_lock_init(&sbi->bitmap_lock);
+	spin_lock_init(&sbi->prealloc_lock);
+	INIT_LIST_HEAD(&sbi->prealloc_list);
 	sb->s_fs_info = sbi;
 
-	brelse(bh);
-
-	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->ifree_bitmap) {
-		ret = -ENOMEM;
+	/* Images made before allocation groups have no group size */
+	if (!sbi->blocks_per_group)
+		sbi->blocks_per_group = OUICHEFS_DEFAULT_BLOCKS_PER_GROUP;
+	if (sbi->blocks_per_group % BITS_PER_LONG) {
+		pr_err("Invalid group size: %u\n", sbi->blocks_per_group);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+	if (sbi->features & ~OUICHEFS_FEATURES) {
+		pr_err("Unsupported features: %#x\n",
+		       sbi->features & ~OUICHEFS_FEATURES);
+		ret = -EINVAL;
 		goto free_sbi;
 	}
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_ifree;
-		}
+	ret = percpu_counter_init(&sbi->free_inodes, csb->nr_free_inodes,
+				  GFP_KERNEL);
+	if (ret)
+		goto free_sbi;
+	/* Counted by the allocation groups */
+	ret = percpu_counter_init(&sbi->free_blocks, 0, GFP_KERNEL);
+	if (ret)
+		goto free_sbi;
+	ret = percpu_counter_init(&sbi->reserved_blocks, 0, GFP_KERNEL);
+	if (ret)
+		goto free_sbi;
 
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+	ret = ouichefs_parse_options(sb, data);
+	if (ret)
+		goto free_sbi;
 
-		brelse(bh);
-	}
+	ret = ouichefs_init_eviction(sb);
+	if (ret)
+		goto free_sbi;
 
-	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
+	brelse(bh);
+	bh = NULL;
+
+	/*
+	 * The inode bitmap and the group free counts table are read at once,
+	 * with the first inode store block (root inode) which is needed right
+	 * after. The block bitmap is only needed now without the table.
+	 */
+	readahead_blocks(sb, 1, 1);
+	readahead_blocks(sb, sbi->nr_istore_blocks + 1, sbi->nr_ifree_blocks);
+	if (sbi->nr_gfree_blocks)
+		readahead_blocks(sb,
+				 sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+					 sbi->nr_bfree_blocks + 1,
+				 sbi->nr_gfree_blocks);
+	else
+		readahead_blocks(sb,
+				 sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+					 1,
+				 sbi->nr_bfree_blocks);
+
+	/* Map ifree_bitmap */
+	sbi->ifree_bhs = kvcalloc(sbi->nr_ifree_blocks, sizeof(*sbi->ifree_bhs),
+				  GFP_KERNEL);
+	if (!sbi->ifree_bhs) {
 		ret = -ENOMEM;
+		goto free_sbi;
+	}
+	sbi->ifree_bitmap = map_bitmap(sb, sbi->nr_istore_blocks + 1,
+				       sbi->nr_ifree_blocks, sbi->ifree_bhs);
+	if (!sbi->ifree_bitmap) {
+		ret = -EIO;
 		goto free_ifree;
 	}
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_bfree;
-		}
-
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+	/* Summarize the inode bitmap for fast free bit lookups */
+	sbi->ifree_summary = alloc_summary(sbi->ifree_bitmap, sbi->nr_inodes);
+	/* Nothing to write back yet */
+	sbi->ifree_dirty = bitmap_zalloc(sbi->nr_ifree_blocks, GFP_KERNEL);
+	sbi->bfree_dirty = bitmap_zalloc(sbi->nr_bfree_blocks, GFP_KERNEL);
+	if (!sbi->ifree_summary || !sbi->ifree_dirty || !sbi->bfree_dirty) {
+		ret = -ENOMEM;
+		goto free_summary;
+	}
 
-		brelse(bh);
+	/* Split the blocks in allocation groups */
+	ret = ouichefs_init_groups(sb, state);
+	if (ret)
+		goto free_groups;
+	/* Until the next clean unmount, the table may fall behind */
+	if (!sb_rdonly(sb) && sbi->nr_gfree_blocks) {
+		ret = write_state(sb, 0);
+		if (ret)
+			goto free_groups;
 	}
 
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_groups;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
@@ -338,12 +827,21 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 
 iput:
 	iput(root_inode);
-free_bfree:
-	kfree(sbi->bfree_bitmap);
+free_groups:
+	release_groups(sbi);
+free_summary:
+	bitmap_free(sbi->ifree_summary);
+	bitmap_free(sbi->ifree_dirty);
+	bitmap_free(sbi->bfree_dirty);
 free_ifree:
-	kfree(sbi->ifree_bitmap);
+	unmap_bitmap(sbi->ifree_bitmap, sbi->ifree_bhs, sbi->nr_ifree_blocks);
 free_sbi:
+	ouichefs_release_eviction(sb);
+	percpu_counter_destroy(&sbi->free_inodes);
+	percpu_counter_destroy(&sbi->free_blocks);
+	percpu_counter_destroy(&sbi->reserved_blocks);
 	kfree(sbi);
+	sb->s_fs_info = NULL;
 release:
 	brelse(bh);
 
@@ -137,7 +137,7 @@ static int clean_dir(struct super_block *sb, struct inode *parent,
 
 	for (int i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
 		if (!files[i].inode)
-			break;
+			continue;
 
 		pr_info("    %s\n", files[i].filename);
 	}
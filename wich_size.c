@@ -8,134 +8,54 @@
 #include "ouichefs.h"
 #include "eviction_policy/eviction_policy.h"
 
-struct size_data {
-	struct inode *parent;
-	struct inode *child;
-};
-
 /**
- * leaf_action - Perform an action on a leaf node during traversal
+ * compare - Orders the victim index of the partitions, biggest file first.
  *
- * @parent: The parent node of the leaf node.
- * @child: The leaf node to perform the action on.
- * @data: The data associated with the traversal.
+ * @a: The first file.
+ * @b: The second file.
  *
- * This function is called during traversal of a file system tree on a leaf node.
- * It compares the size of the child inode with the size of the current biggest file and updates the
- * biggest file if necessary.
+ * Return: A negative value if a is bigger, a positive value if b is bigger,
+ *         and zero if both have the same size.
  */
-static void leaf_action(struct traverse_node *parent,
-			struct traverse_node *child, void *data)
+static int compare(const struct ouichefs_victim *a,
+		   const struct ouichefs_victim *b)
 {
-	struct size_data *to_del = (struct size_data *)data;
-
-	pr_info("Leaf: %s\tsize: %lld\n", child->file->filename,
-		child->inode->i_size);
-
-	// If this inode is in use, skip it
-	if (ouichefs_file_in_use(child->inode)) {
-		pr_info("Skipping inode: %lu, it's in use\n",
-			child->inode->i_ino);
-		return;
-	}
-
-	if (to_del->child == NULL) {
-		to_del->parent = parent->inode;
-		to_del->child = child->inode;
-
-		pr_info("New biggest file is: %s in directory: %s\n",
-			child->file->filename, parent->file->filename);
-		return;
-	}
-
-	if (to_del->child->i_size < child->inode->i_size) {
-		to_del->parent = parent->inode;
-		to_del->child = child->inode;
-
-		pr_info("New biggest file is: %s in directory: %s\n",
-			child->file->filename, parent->file->filename);
-	}
-
-	// TODO: possible optimization: if the file is 4 KiB (max possible) break the search
+	if (a->size > b->size)
+		return -1;
+	if (a->size < b->size)
+		return 1;
+	return 0;
 }
 
 /**
- * clean_partition - Cleans the partition by removing a file from a directory.
+ * clean_partition - Cleans the partition by removing the biggest file.
  *
  * @sb: The super_block structure pointer.
  *
- * This function is responsible for cleaning the partition by removing a file
- * from a directory. It reads the directory index block on disk, traverses the
- * directory structure to find the biggest file and removes it.
+ * The files of the partition are kept ordered by size in the victim index, and
+ * open files are kept out of it, so the biggest file that can be removed is
+ * found without scanning the partition.
  *
- * Return: 0 on success, -EIO on failure.
+ * Return: 0 on success, negative error code on failure.
  */
 static int clean_partition(struct super_block *sb)
 {
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-
-	struct ouichefs_inode *root_wich_inode = get_root_inode(sb);
-
-	if (!root_wich_inode) {
-		pr_info("No root inode\n");
-		return -EIO;
-	}
-
-	if (!root_wich_inode->index_block)
-		return -EIO;
-
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, root_wich_inode->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
-
-	// Prepare for search in file tree
-
-	struct ouichefs_file root_file = {
-		.filename = "/",
-		.inode = 0,
-	};
-
-	struct inode *root_inode = ouichefs_iget(sb, 0);
-
-	struct traverse_node root_node = {
-		.file = &root_file,
-		.inode = root_inode,
-	};
-
-	struct size_data to_del = { .child = NULL, .parent = root_inode };
-
-	// Search for the biggest file in the file tree
-
-	traverse_dir(sb, dir_block, &root_node, NULL, NULL, leaf_action,
-		     &to_del);
-
-	// Check if anything has been found
-
-	if (to_del.child == NULL) {
-		pr_info("No file to delete\n");
-		goto cleanup;
-	}
-
-	if (to_del.child == root_inode) {
-		pr_info("Can't delete root directory\n");
-		goto cleanup;
-	}
-
-	pr_info("Removing file: %lu in directory: %lu\n", to_del.child->i_ino,
-		to_del.parent->i_ino);
-
-	if (ouichefs_remove_file(to_del.parent, to_del.child))
-		pr_err("Failed to remove file\n");
-
-
-cleanup:
-	iput(root_inode);
-	brelse(bh);
+	return ouichefs_evict_victim(sb);
+}
 
-	return 0;
+/**
+ * reclaim - Frees nr_blocks blocks by removing a batch of files.
+ *
+ * @sb: The super_block structure pointer.
+ * @nr_blocks: The number of blocks to free.
+ *
+ * The victims are taken from the left of the victim index in one go.
+ *
+ * Return: the number of blocks freed, or a negative error code.
+ */
+static int reclaim(struct super_block *sb, uint32_t nr_blocks)
+{
+	return ouichefs_evict_victims(sb, nr_blocks);
 }
 
 /**
@@ -165,7 +85,7 @@ static int clean_dir(struct super_block *sb, struct inode *parent,
 		f = &(files[i]);
 
 		if (!f->inode)
-			break;
+			continue;
 
 		inode = ouichefs_iget(sb, f->inode);
 
@@ -208,6 +128,8 @@ static struct ouichefs_eviction_policy wich_size_policy = {
 	.name = "wich_size",
 	.clean_dir = clean_dir,
 	.clean_partition = clean_partition,
+	.compare = compare,
+	.reclaim = reclaim,
 	.list_head = LIST_HEAD_INIT(wich_size_policy.list_head),
 };
 